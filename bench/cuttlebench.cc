@@ -0,0 +1,193 @@
+#include "cuttle.hh"
+
+#include "cuttlepool.hh"
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDirIterator>
+#include <QElapsedTimer>
+#include <QSet>
+#include <QTemporaryDir>
+
+#include <cstdio>
+#include <random>
+
+// deterministic synthetic corpus: unrelated base images plus exact copies, re-encodes, resizes and crops of a fraction of them
+
+static QImage synth_image(std::mt19937 & rng, QSize size) {
+	std::uniform_real_distribution<float> unit {0.0f, 1.0f};
+	QImage img {size, QImage::Format_RGB32};
+	
+	float base[2][3];
+	for (auto & c : base) for (float & v : c) v = unit(rng) * 255.0f;
+	
+	struct blob_t {
+		float x, y, rx, ry;
+		QRgb color;
+	};
+	std::vector<blob_t> blobs (8);
+	for (blob_t & b : blobs) {
+		b.x = unit(rng) * size.width();
+		b.y = unit(rng) * size.height();
+		b.rx = (0.05f + unit(rng) * 0.3f) * size.width();
+		b.ry = (0.05f + unit(rng) * 0.3f) * size.height();
+		b.color = qRgb(rng() & 0xFF, rng() & 0xFF, rng() & 0xFF);
+	}
+	
+	for (int y = 0; y < size.height(); y++) {
+		QRgb * line = reinterpret_cast<QRgb *>(img.scanLine(y));
+		float t = static_cast<float>(y) / size.height();
+		for (int x = 0; x < size.width(); x++) {
+			QRgb px = qRgb(base[0][0] * (1 - t) + base[1][0] * t, base[0][1] * (1 - t) + base[1][1] * t, base[0][2] * (1 - t) + base[1][2] * t);
+			for (blob_t const & b : blobs) {
+				float dx = (x - b.x) / b.rx, dy = (y - b.y) / b.ry;
+				if (dx * dx + dy * dy < 1.0f) px = b.color;
+			}
+			line[x] = px;
+		}
+	}
+	return img;
+}
+
+struct corpus_t {
+	size_t files = 0;
+	std::vector<std::pair<QString, QString>> expected {}; // pairs that should match
+};
+
+static corpus_t synth_corpus(QString const & dir, size_t count, QSize size, double variants, uint32_t seed) {
+	corpus_t corpus {};
+	std::mt19937 rng {seed};
+	std::uniform_real_distribution<double> unit {0.0, 1.0};
+	
+	for (size_t i = 0; i < count; i++) {
+		QImage img = synth_image(rng, size);
+		QString base = QString {"%1/%2"}.arg(dir).arg(i, 6, 10, QChar('0'));
+		QString orig = base + ".jpg";
+		img.save(orig, "JPEG", 90);
+		corpus.files++;
+		
+		if (unit(rng) >= variants) continue;
+		
+		QString copy = base + "_copy.jpg";
+		QFile::copy(orig, copy);
+		QString reenc = base + "_reenc.jpg";
+		img.save(reenc, "JPEG", 60);
+		QString resize = base + "_resize.png";
+		img.scaled(size * 0.6, Qt::IgnoreAspectRatio, Qt::SmoothTransformation).save(resize, "PNG");
+		QString crop = base + "_crop.jpg";
+		img.copy(size.width() / 20, size.height() / 20, size.width() * 9 / 10, size.height() * 9 / 10).save(crop, "JPEG", 90);
+		corpus.files += 4;
+		
+		for (QString const & v : {copy, reenc, resize, crop}) corpus.expected.emplace_back(orig, v);
+	}
+	return corpus;
+}
+
+// a corpus generated by an earlier run, the variants are recognized by the suffixes synth_corpus gives them
+static corpus_t scan_corpus(QString const & dir) {
+	corpus_t corpus {};
+	QDirIterator diter {dir, QDir::Files};
+	while (diter.hasNext()) {
+		QString path = diter.next();
+		QString name = diter.fileName();
+		corpus.files++;
+		for (QString const & suffix : {"_copy.jpg", "_reenc.jpg", "_resize.png", "_crop.jpg"}) {
+			if (name.endsWith(suffix)) corpus.expected.emplace_back(QString {"%1/%2.jpg"}.arg(dir, name.chopped(suffix.size())), path);
+		}
+	}
+	return corpus;
+}
+
+int main(int argc, char * * argv) {
+	QCoreApplication app {argc, argv};
+	
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Times every phase of the cuttlefish pipeline on a synthetic corpus.");
+	parser.addHelpOption();
+	QCommandLineOption countOpt {{"n", "count"}, "Unrelated base images.", "n", "500"};
+	QCommandLineOption widthOpt {"width", "Base image width.", "px", "1024"};
+	QCommandLineOption heightOpt {"height", "Base image height.", "px", "768"};
+	QCommandLineOption variantOpt {"variants", "Fraction of base images that also get a copy, re-encode, resize and crop.", "ratio", "0.2"};
+	QCommandLineOption seedOpt {"seed", "Generator seed.", "n", "1"};
+	QCommandLineOption resOpt {{"r", "res"}, "Signature resolution.", "n", "32"};
+	QCommandLineOption threshOpt {{"t", "threshold"}, "Threshold for the query phase.", "value", "0.85"};
+	QCommandLineOption threadsOpt {{"j", "threads"}, "Worker thread count, 0 uses every core.", "n", "0"};
+	QCommandLineOption searchOpt {{"s", "search"}, "Pair search, exhaustive, phash or histogram.", "mode", "exhaustive"};
+	QCommandLineOption dirOpt {"dir", "Generate into this directory instead of a temporary one, a directory that already holds files is benchmarked as it is.", "path"};
+	parser.addOptions({countOpt, widthOpt, heightOpt, variantOpt, seedOpt, resOpt, threshOpt, threadsOpt, searchOpt, dirOpt});
+	parser.process(app);
+	
+	CuttlePool::instance().setThreadCount(parser.value(threadsOpt).toUInt());
+	
+	QTemporaryDir tmp {};
+	QString dir = parser.isSet(dirOpt) ? parser.value(dirOpt) : tmp.path();
+	QDir {}.mkpath(dir);
+	
+	QElapsedTimer timer;
+	timer.start();
+	corpus_t corpus {};
+	if (!QDir {dir}.isEmpty(QDir::Files)) {
+		corpus = scan_corpus(dir);
+		fprintf(stderr, "reusing %zu files, the generator options are ignored\n", corpus.files);
+	} else {
+		corpus = synth_corpus(dir, parser.value(countOpt).toUInt(), {parser.value(widthOpt).toInt(), parser.value(heightOpt).toInt()}, parser.value(variantOpt).toDouble(), parser.value(seedOpt).toUInt());
+		fprintf(stderr, "generated %zu files in %.2f s\n", corpus.files, timer.nsecsElapsed() / 1e9);
+	}
+	
+	double thresh = parser.value(threshOpt).toDouble();
+	CuttleProcessor processor {nullptr};
+	processor.setCachePath({});
+	processor.setMatchFloor(thresh);
+	if (parser.value(searchOpt) == "phash") processor.setSearchMode(CuttleSearchMode::phash);
+	else if (parser.value(searchOpt) == "histogram") processor.setSearchMode(CuttleSearchMode::histogram);
+	
+	// the processor reports phase changes through section, those timestamps delimit the phases
+	std::vector<std::pair<QString, qint64>> sections {};
+	QObject::connect(&processor, &CuttleProcessor::section, [&](QString str){
+		sections.emplace_back(str.remove(" %p%"), timer.nsecsElapsed());
+	});
+	QObject::connect(&processor, &CuttleProcessor::finished, &app, &QCoreApplication::quit, Qt::QueuedConnection);
+	
+	QList<CuttleDirectory> dirs {{dir, false}};
+	timer.restart();
+	processor.beginProcessing(dirs, std::max(1u, parser.value(resOpt).toUInt()));
+	app.exec();
+	sections.emplace_back("end", timer.nsecsElapsed());
+	
+	// the pairs the search mode actually scored, phash and histogram propose far fewer than every pair
+	CuttleRunStats const & stats = processor.getRunStats();
+	double const pairs = stats.pairs_compared;
+	
+	printf("%-24s %10s %14s\n", "phase", "seconds", "rate");
+	for (size_t i = 0; i + 1 < sections.size(); i++) {
+		double secs = (sections[i + 1].second - sections[i].second) / 1e9;
+		QString const & name = sections[i].first;
+		if (name.startsWith("Loading images")) printf("%-24s %10.3f %10.1f img/s\n", qPrintable(name), secs, corpus.files / secs);
+		else if (name.startsWith("Generating deltas")) printf("%-24s %10.3f %10.3g pairs/s\n", qPrintable(name), secs, pairs / secs);
+		else printf("%-24s %10.3f\n", qPrintable(name), secs);
+	}
+	// discovery runs alongside loading, its own clock stops when the walkers have listed every directory
+	printf("%-24s %10.3f %10.1f files/s (overlaps loading)\n", "Discovery", stats.discovery_seconds, stats.files / std::max(stats.discovery_seconds, 1e-9));
+	
+	timer.restart();
+	std::vector<CuttleMatchPair> found = processor.getPairsAboveThresh(thresh);
+	double query_pairs = timer.nsecsElapsed() / 1e9;
+	timer.restart();
+	size_t left = processor.getSetsAboveThresh(thresh).size();
+	double query_sets = timer.nsecsElapsed() / 1e9;
+	printf("%-24s %10.3f %10zu pairs\n", "Query pairs", query_pairs, found.size());
+	printf("%-24s %10.3f %10zu sets\n", "Query sets", query_sets, left);
+	
+	QSet<QPair<QString, QString>> found_set {};
+	for (CuttleMatchPair const & pair : found) {
+		found_set.insert({QFileInfo {pair.A->filename}.fileName(), QFileInfo {pair.B->filename}.fileName()});
+		found_set.insert({QFileInfo {pair.B->filename}.fileName(), QFileInfo {pair.A->filename}.fileName()});
+	}
+	size_t recalled = 0;
+	for (auto const & pair : corpus.expected) {
+		if (found_set.contains({QFileInfo {pair.first}.fileName(), QFileInfo {pair.second}.fileName()})) recalled++;
+	}
+	printf("recall %zu / %zu expected variant pairs at threshold %.3f\n", recalled, corpus.expected.size(), thresh);
+	
+	return 0;
+}
@@ -1,5 +1,8 @@
 #include "cuttle.hh"
 
+#include "cuttlepool.hh"
+#include "cuttletrace.hh"
+
 #include <atomic>
 #include <future>
 #include <thread>
@@ -10,6 +13,8 @@
 #include <QDebug>
 #include <QShortcut>
 
+static constexpr int prefetch_ahead = 3;
+
 CuttleCore::CuttleCore() : QMainWindow() {
 	
 	builder = new CuttleBuilder {this};
@@ -25,29 +30,27 @@ CuttleCore::CuttleCore() : QMainWindow() {
 	QHBoxLayout * viewLayout = new QHBoxLayout {viewCont};
 	viewLayout->setContentsMargins(0, 0, 0, 0);
 	
-	QScrollArea * leftListArea = new QScrollArea {viewCont};
-	QWidget * leftListWidget = new QWidget {leftListArea};
-	leftListArea->setVerticalScrollBarPolicy(Qt::ScrollBarAlwaysOn);
-	leftListArea->setWidgetResizable(true);
-	leftListArea->setMinimumWidth(LEFT_COLUMN_SIZE);
-	leftListArea->setMaximumWidth(LEFT_COLUMN_SIZE);
-	leftListWidget->setMinimumWidth(LEFT_COLUMN_SIZE - 20);
-	leftListWidget->setMaximumWidth(LEFT_COLUMN_SIZE - 20);
-	leftListArea->setWidget(leftListWidget);
-	QVBoxLayout * leftListLayout = new QVBoxLayout {leftListWidget};
-	viewLayout->addWidget(leftListArea);
-	
-	QScrollArea * rightListArea = new QScrollArea {viewCont};
-	QWidget * rightListWidget = new QWidget {rightListArea};
-	rightListArea->setVerticalScrollBarPolicy(Qt::ScrollBarAlwaysOn);
-	rightListArea->setWidgetResizable(true);
-	rightListArea->setMinimumWidth(RIGHT_COLUMN_SIZE);
-	rightListArea->setMaximumWidth(RIGHT_COLUMN_SIZE);
-	rightListWidget->setMinimumWidth(RIGHT_COLUMN_SIZE - 20);
-	rightListWidget->setMaximumWidth(RIGHT_COLUMN_SIZE - 20);
-	rightListArea->setWidget(rightListWidget);
-	QVBoxLayout * rightListLayout = new QVBoxLayout {rightListWidget};
-	viewLayout->addWidget(rightListArea);
+	leftModel = new CuttleSetModel {this, "High: %1"};
+	QListView * leftListView = new QListView {viewCont};
+	leftListView->setModel(leftModel);
+	leftListView->setItemDelegate(new CuttleSetDelegate {leftListView});
+	leftListView->setUniformItemSizes(true);
+	leftListView->setVerticalScrollBarPolicy(Qt::ScrollBarAlwaysOn);
+	leftListView->setSelectionMode(QAbstractItemView::SingleSelection);
+	leftListView->setMinimumWidth(LEFT_COLUMN_SIZE);
+	leftListView->setMaximumWidth(LEFT_COLUMN_SIZE);
+	viewLayout->addWidget(leftListView);
+	
+	rightModel = new CuttleSetModel {this, "Value: %1"};
+	QListView * rightListView = new QListView {viewCont};
+	rightListView->setModel(rightModel);
+	rightListView->setItemDelegate(new CuttleSetDelegate {rightListView});
+	rightListView->setUniformItemSizes(true);
+	rightListView->setVerticalScrollBarPolicy(Qt::ScrollBarAlwaysOn);
+	rightListView->setSelectionMode(QAbstractItemView::SingleSelection);
+	rightListView->setMinimumWidth(RIGHT_COLUMN_SIZE);
+	rightListView->setMaximumWidth(RIGHT_COLUMN_SIZE);
+	viewLayout->addWidget(rightListView);
 	
 	QWidget * activeWidget = new QWidget {viewCont};
 	QVBoxLayout * activeLayout = new QVBoxLayout {activeWidget};
@@ -179,7 +182,10 @@ CuttleCore::CuttleCore() : QMainWindow() {
 	QShortcut * shortL = new QShortcut(QKeySequence(tr("1", "View Left")), this);
 	QShortcut * shortR = new QShortcut(QKeySequence(tr("2", "View Right")), this);
 	
+	connect(builder, &CuttleBuilder::searchMode, processor, &CuttleProcessor::setSearchMode);
+	connect(builder, &CuttleBuilder::watch, processor, &CuttleProcessor::setWatch);
 	connect(builder, &CuttleBuilder::begin, processor, &CuttleProcessor::beginProcessing);
+	connect(builder, &CuttleBuilder::begin, this, [this](){ images.clear(); }); // files may have changed since the last run
 	//connect(raiButton, &QPushButton::clicked, processor, &CuttleProcessor::remove_all_idential);
 	connect(newButton, &QPushButton::clicked, builder, &CuttleBuilder::focus);
 	connect(stopButton, &QPushButton::clicked, processor, [this](){this->processor->stop();});
@@ -199,167 +205,180 @@ CuttleCore::CuttleCore() : QMainWindow() {
 	
 	auto startUIFunc =  [=](){
 		this->view->setImage({});
-		leftListArea->setEnabled(false);
-		rightListArea->setEnabled(false);
+		leftListView->setEnabled(false);
+		rightListView->setEnabled(false);
 		newButton->setEnabled(false);
 		
-		for (CuttleLeftItem * item : leftList) {
-			delete item;
-		}
-		leftList.clear();
-		
-		for (CuttleRightItem * item : rightList) {
-			delete item;
-		}
-		rightList.clear();
+		leftModel->clear();
+		rightModel->clear();
+		active = compared = nullptr;
 		
 		if (cItemL) delete cItemL;
 		if (cItemR) delete cItemR;
 		cItemL = cItemR = cItemA = nullptr;
 	};
 	
-	auto finishUIFunc = [=](){
-		leftListArea->setEnabled(true);
-		rightListArea->setEnabled(true);
-		newButton->setEnabled(true);
+	auto comp_func = [=](CuttleSet const * set){
+		CuttleSet const * active_set = active;
+		compared = set;
+		
+		if (cItemL) delete cItemL;
+		if (cItemR) delete cItemR;
+		cItemL = cItemR = cItemA = nullptr;
+		
+		images.prefetch(set); // decodes on the pool while the active image is fetched here
+		QImage iL = images.get(active_set);
+		QImage iR = images.get(set);
 		
-		for (CuttleSet const * set : processor->getSetsAboveThresh(threshSpin->value())) {
+		// ================================
+		
+		diffButton->disconnect();
+		connect(diffButton, &QPushButton::clicked, this, [=]() {
+			QImage A = iL, B = iR;
+			if (A.size() != B.size()) {
+				auto As = A.width() * A.height(), Bs = B.width() * B.height();
+				if (As > Bs)
+					B = B.scaled(A.size(), Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+				else 
+					A = A.scaled(B.size(), Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+			}
 			
-			CuttleLeftItem * item = new CuttleLeftItem {leftListArea, set, processor};
-			leftList.append(item);
+			QImage C {A.size(), QImage::Format_RGB32};
 			
-			connect(item, &CuttleLeftItem::activated, this, [=](CuttleSet const * active_set) {
-				auto comp_func = [=](CuttleSet const * set){
-					if (cItemL) delete cItemL;
-					if (cItemR) delete cItemR;
-					cItemL = cItemR = cItemA = nullptr;
-					
-					auto iRa = std::async(std::launch::async, [&set](){ return set->getImage(); });
-					QImage iL = active_set->getImage();
-					QImage iR = iRa.get();
-					
-					// ================================
-					
-					diffButton->disconnect();
-					connect(diffButton, &QPushButton::clicked, this, [=]() {
-						QImage A = iL, B = iR;
-						if (A.size() != B.size()) {
-							auto As = A.width() * A.height(), Bs = B.width() * B.height();
-							if (As > Bs)
-								B = B.scaled(A.size(), Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
-							else 
-								A = A.scaled(B.size(), Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
-						}
-						
-						QImage C {A.size(), QImage::Format_RGB32};
-						
-						struct diff_state_t {
-							int const lines;
-							std::atomic_int line;
-						} diff_state {
-							.lines = A.height(),
-							.line = 0,
-						};
-						
-						float const mult = 255.0f / (256 - diffSlider->value());
-						
-						auto thread_func = [&diff_state, &A, &B, &C, mult] () {
-							int y;
-							while ((y = diff_state.line.fetch_add(1)) < diff_state.lines) {
-								QRgb * line_data = reinterpret_cast<QRgb *>(C.scanLine(y));
-								for (int x = 0; x < A.width(); x++) {
-									QColor pA = A.pixel(x, y), pB = B.pixel(x, y), pC;
-									pC.setRgbF(qAbs(pA.redF() - pB.redF()) * mult, qAbs(pA.greenF() - pB.greenF()) * mult, qAbs(pA.blueF() - pB.blueF()) * mult);
-									line_data[x] = pC.rgb();
-								}
-							}
-						};
-						
-						std::vector<std::thread> threads;
-						for (size_t i = 0; i < std::thread::hardware_concurrency(); i++) threads.emplace_back(thread_func);
-						for (auto & t : threads) t.join();
-						threads.clear();
-						
-						view->setImagePreserve(C);
-					});
-					
-					// ================================
-					
-					CuttleCompInfo set_c, active_set_c;
-					CuttleCompInfo::GetCompInfo(set, active_set, set_c, active_set_c);
-					
-					cItemL = new CuttleCompItem {activeCompWidget, active_set, active_set_c, processor};
-					cItemR = new CuttleCompItem {activeCompWidget, set, set_c, processor};
-					
-					cItemA = cItemL;
-					
-					shortL->disconnect();
-					shortR->disconnect();
-					connect(shortL, &QShortcut::activated, this, [this, iL](){ view->setImagePreserve(iL); });
-					connect(shortR, &QShortcut::activated, this, [this, iR](){ view->setImagePreserve(iR); });
-					
-					connect(cItemL, &CuttleCompItem::view, this, [this, iL](){ view->setImagePreserve(iL); });
-					connect(cItemR, &CuttleCompItem::view, this, [this, iR](){ view->setImagePreserve(iR); });
-					
-					auto deleteme_func = [=](CuttleSet const * set) {
-						QFile::remove(set->filename);
-						processor->remove(set);
-					};
-					connect(cItemL, &CuttleCompItem::delete_me, this, deleteme_func);
-					connect(cItemR, &CuttleCompItem::delete_me, this, deleteme_func);
-					
-					ignoreButton->disconnect();
-					connect(ignoreButton, &QPushButton::clicked, this, [=]() {
-						processor->remove(set, active_set);
-					});
-					
-					activeCompLayout->addWidget(cItemL);
-					activeCompLayout->addWidget(cItemR);
-					
-					view->setImagePreserve(set->getImage());
-				};
-				for (CuttleRightItem * item : rightList) {
-					delete item;
-				}
-				rightList.clear();
-				for (CuttleSet const * set : processor->getSetsAboveThresh(active_set, threshSpin->value())) {
-					if (set->id == active_set->id) continue;
-					CuttleRightItem * item = new CuttleRightItem {rightListWidget, set, active_set, processor};
-					rightList.append(item);
-					
-					connect(item, &CuttleRightItem::activated, this, comp_func);
-				}
-				std::sort(rightList.begin(), rightList.end(), [](CuttleRightItem const * A, CuttleRightItem const * B){return A->getValue() > B->getValue();});
-				for (CuttleRightItem * item : rightList) {
-					rightListLayout->addWidget(item);
+			float const mult = 255.0f / (256 - diffSlider->value());
+			
+			CuttlePool::instance().parallel_for(A.height(), [&A, &B, &C, mult](size_t y) {
+				QRgb * line_data = reinterpret_cast<QRgb *>(C.scanLine(y));
+				for (int x = 0; x < A.width(); x++) {
+					QColor pA = A.pixel(x, y), pB = B.pixel(x, y), pC;
+					pC.setRgbF(qAbs(pA.redF() - pB.redF()) * mult, qAbs(pA.greenF() - pB.greenF()) * mult, qAbs(pA.blueF() - pB.blueF()) * mult);
+					line_data[x] = pC.rgb();
 				}
-				comp_func(rightList[0]->set);
-				view->setImage(active_set->getImage(), ImageView::KEEP_FIT_FORCE);
 			});
-		}
-		std::sort(leftList.begin(), leftList.end(), [](CuttleLeftItem const * A, CuttleLeftItem const * B){return A->getHigh() > B->getHigh();});
-		for (CuttleLeftItem * item : leftList) {
-			leftListLayout->addWidget(item);
-		}
+			
+			view->setImagePreserve(C);
+		});
+		
+		// ================================
+		
+		CuttleCompInfo set_c, active_set_c;
+		CuttleCompInfo::GetCompInfo(processor->getSignatures(), set, active_set, set_c, active_set_c);
+		
+		cItemL = new CuttleCompItem {activeCompWidget, active_set, active_set_c, processor};
+		cItemR = new CuttleCompItem {activeCompWidget, set, set_c, processor};
+		
+		cItemA = cItemL;
+		
+		shortL->disconnect();
+		shortR->disconnect();
+		connect(shortL, &QShortcut::activated, this, [this, iL](){ view->setImagePreserve(iL); });
+		connect(shortR, &QShortcut::activated, this, [this, iR](){ view->setImagePreserve(iR); });
+		
+		connect(cItemL, &CuttleCompItem::view, this, [this, iL](){ view->setImagePreserve(iL); });
+		connect(cItemR, &CuttleCompItem::view, this, [this, iR](){ view->setImagePreserve(iR); });
+		
+		auto deleteme_func = [=](CuttleSet const * set) {
+			QFile::remove(set->filename);
+			images.forget(set->filename);
+			processor->remove(set);
+		};
+		connect(cItemL, &CuttleCompItem::delete_me, this, deleteme_func);
+		connect(cItemR, &CuttleCompItem::delete_me, this, deleteme_func);
+		
+		ignoreButton->disconnect();
+		connect(ignoreButton, &QPushButton::clicked, this, [=]() {
+			processor->remove(set, active_set);
+		});
+		
+		activeCompLayout->addWidget(cItemL);
+		activeCompLayout->addWidget(cItemR);
+		
+		view->setImagePreserve(iR);
+		
+		// the next few candidates on the right and the next set on the left are likely to be looked at next
+		int const row = rightModel->rowOf(set);
+		for (int i = 1; i <= prefetch_ahead; i++) if (CuttleSet const * next = rightModel->setAt(row + i)) images.prefetch(next);
+		if (CuttleSet const * next = leftModel->setAt(leftModel->rowOf(active_set) + 1)) images.prefetch(next);
+	};
+	
+	auto activate_func = [=](CuttleSet const * active_set){
+		CuttleTraceSpan span {"populate right list"};
+		active = active_set;
+		compared = nullptr;
+		rightModel->assign(processor->getSetsAboveThresh(active_set, threshSpin->value()), [=](CuttleSet const * set){ return processor->getMatchData(set, active_set).value(); });
+		if (rightModel->rowCount()) rightListView->setCurrentIndex(rightModel->index(0));
+		view->setImage(images.get(active_set), ImageView::KEEP_FIT_FORCE);
+	};
+	
+	// choosing a row, by mouse or keyboard, moves the current index; restoring the same row after a refresh does nothing
+	connect(leftListView->selectionModel(), &QItemSelectionModel::currentChanged, this, [=](QModelIndex const & current){
+		CuttleSet const * set = leftModel->setAt(current.row());
+		if (set && set != active) activate_func(set);
+	});
+	connect(rightListView->selectionModel(), &QItemSelectionModel::currentChanged, this, [=](QModelIndex const & current){
+		CuttleSet const * set = rightModel->setAt(current.row());
+		if (set && set != compared) comp_func(set);
+	});
+	
+	auto finishUIFunc = [=](){
+		CuttleTraceSpan span {"populate left list"};
+		leftListView->setEnabled(true);
+		rightListView->setEnabled(true);
+		newButton->setEnabled(true);
+		
+		leftModel->assign(processor->getSetsAboveThresh(threshSpin->value()), [=](CuttleSet const * set){ return processor->getHigh(set); });
 		
 		// TODO -- Setting
-		if (leftList.size()) leftList[0]->activate();
+		if (leftModel->rowCount()) leftListView->setCurrentIndex(leftModel->index(0));
 		
 	};
 	
 	connect(processor, &CuttleProcessor::started, this, startUIFunc, Qt::QueuedConnection);
 	connect(processor, &CuttleProcessor::finished, this, finishUIFunc, Qt::QueuedConnection);
 	
+	// watch mode rescans update the lists in place, the active comparison is kept unless one of its sets went away
+	connect(processor, &CuttleProcessor::updated, this, [=](std::vector<uint32_t> const &, std::vector<uint32_t> const & removed){
+		CuttleTraceSpan span {"update lists"};
+		double const thresh = threshSpin->value();
+		
+		// a file rewritten in place comes back as a removal and an addition under the same name, only those images are dropped
+		if (!removed.empty()) {
+			std::unordered_set<uint32_t> const gone {removed.begin(), removed.end()};
+			for (CuttleSet const & set : processor->getSets()) {
+				if (gone.count(set.id)) images.forget(set.filename);
+			}
+		}
+		
+		if ((cItemL && cItemL->set->delete_me) || (cItemR && cItemR->set->delete_me)) {
+			delete cItemL;
+			delete cItemR;
+			cItemL = cItemR = cItemA = nullptr;
+			compared = nullptr;
+			view->setImage({});
+		}
+		if (active && active->delete_me) {
+			active = compared = nullptr;
+			rightModel->clear();
+		}
+		
+		// both columns are prefixes of the processor's ranking, so they are rebuilt rather than patched
+		leftModel->assign(processor->getSetsAboveThresh(thresh), [=](CuttleSet const * set){ return processor->getHigh(set); });
+		if (!active) return;
+		leftListView->setCurrentIndex(leftModel->index(leftModel->rowOf(active)));
+		rightModel->assign(processor->getSetsAboveThresh(active, thresh), [=, active_set = active](CuttleSet const * set){ return processor->getMatchData(set, active_set).value(); });
+		if (compared) rightListView->setCurrentIndex(rightModel->index(rightModel->rowOf(compared)));
+	});
+	
 	connect(threshButton, &QPushButton::clicked, this, [=](){
 		startUIFunc();
 		finishUIFunc();
 	});
 }
 
-void CuttleCompInfo::GetCompInfo(CuttleSet const * A, CuttleSet const * B, CuttleCompInfo & Ac, CuttleCompInfo & Bc) {
+void CuttleCompInfo::GetCompInfo(CuttleSignatureArena const & sigs, CuttleSet const * A, CuttleSet const * B, CuttleCompInfo & Ac, CuttleCompInfo & Bc) {
 	
 	if (A->img_size == B->img_size) {
-		Ac.equal = Bc.equal = (A->img_hash == B->img_hash);
+		Ac.equal = Bc.equal = (sigs.imageHash(A->id) == sigs.imageHash(B->id));
 	} else {
 		Ac.equal = Bc.equal = false;
 	}
@@ -3,16 +3,33 @@
 #include <QMainWindow>
 #include <QDir>
 #include <QList>
+#include <QHash>
+#include <QSet>
 #include <QFrame>
 #include <QDebug>
+#include <QFileSystemWatcher>
+#include <QTimer>
+#include <QAbstractListModel>
+#include <QStyledItemDelegate>
 
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include "cuttlebudget.hh"
 #include "imgview.hh"
+#include "rw_spinlock.hh"
 
 #include <opencv2/opencv.hpp>
 
@@ -34,6 +51,12 @@ struct CuttleDirectory {
 
 struct CuttleNullImageException { };
 
+enum struct CuttleSearchMode {
+	exhaustive, // every pair is scored
+	phash, // only pairs within the perceptual hash radius are scored
+	histogram, // only the nearest histogram neighbours of each set are scored
+};
+
 //================================
 //--------------------------------
 //================================
@@ -58,6 +81,8 @@ public:
 	void focus();
 signals:
 	void begin(QList<CuttleDirectory> const &, size_t res);
+	void searchMode(CuttleSearchMode);
+	void watch(bool);
 protected:
 	void buildView();
 	QList<CuttleDirectory> dirs;
@@ -69,38 +94,320 @@ protected:
 //--------------------------------
 //================================
 
+// Match score in 15 bit fixed point with the identical flag in the top bit. Ordering the raw bits ranks identical pairs
+// first and the rest by score, so thresholds and sorts work on the compact form without converting back.
 struct CuttleMatchData {
-	double value;
-	bool identical;
+	static constexpr uint16_t identical_bit = 0x8000;
+	static constexpr uint16_t score_max = 0x7FFF;
+	uint16_t bits;
+	
+	static constexpr uint16_t quantize(double value) {
+		return value <= 0 ? 0 : value >= 1 ? score_max : static_cast<uint16_t>(value * score_max + 0.5);
+	}
+	static constexpr CuttleMatchData make(double value, bool identical = false) {
+		return { static_cast<uint16_t>(quantize(value) | (identical ? identical_bit : 0)) };
+	}
+	inline constexpr uint16_t score() const { return bits & score_max; }
+	inline constexpr double value() const { return static_cast<double>(score()) / score_max; }
+	inline constexpr bool identical() const { return bits & identical_bit; }
 };
 
-static constexpr CuttleMatchData perfect_match { 1.0, true };
-static constexpr CuttleMatchData invalid_match { 0.0, false };
+static constexpr CuttleMatchData perfect_match = CuttleMatchData::make(1.0, true);
+static constexpr CuttleMatchData signature_match = CuttleMatchData::make(1.0, false);
+static constexpr CuttleMatchData invalid_match = CuttleMatchData::make(0.0, false);
+
+//--------------------------------
+
+// Sparse symmetric match storage, only pairs scoring at least the floor are kept, optionally pruned to the top K neighbours of each set
+class CuttleMatchStore {
+public:
+	struct Edge {
+		uint32_t A, B;
+		CuttleMatchData data;
+	};
+	struct Neighbour {
+		uint32_t id;
+		CuttleMatchData data;
+	};
+	
+	CuttleMatchStore() = default;
+	
+	void reset(uint_fast32_t size, double floor, uint_fast32_t top_k);
+	void clear();
+	// thread safe, takes ownership of the contents of edges
+	void insert(std::vector<Edge> & edges);
+	void finalize();
+	// appends sets without any edges, existing neighbour lists are kept
+	void grow(uint_fast32_t size);
+	// adds the edges of sets that joined a finalized store, only the new edges are pruned and only the rows they reach move
+	void merge(std::vector<Edge> & edges);
+	void invalidate(uint_fast32_t A, uint_fast32_t B);
+	
+	CuttleMatchData const & get(uint_fast32_t A, uint_fast32_t B) const;
+	inline double getFloor() const { return floor; }
+	inline uint_fast32_t getSize() const { return size; }
+	inline bool accepts(CuttleMatchData const & data) const { return data.identical() || data.score() >= floor_score; }
+	inline size_t getEdgeCount() const { return neighbours.size() / 2; }
+	inline Neighbour const * neighboursBegin(uint_fast32_t id) const { return neighbours.data() + offsets[id]; }
+	inline Neighbour const * neighboursEnd(uint_fast32_t id) const { return neighbours.data() + offsets[id + 1]; }
+private:
+	void prune();
+	Neighbour const * find(uint_fast32_t A, uint_fast32_t B) const;
+	
+	uint_fast32_t size = 0;
+	double floor = 0;
+	uint16_t floor_score = 0;
+	uint_fast32_t top_k = 0;
+	std::mutex lk;
+	std::vector<Edge> pending {};
+	std::vector<uint_fast32_t> offsets {};
+	std::vector<Neighbour> neighbours {};
+};
+
+//--------------------------------
+
+// Signatures of every set, one slot per set id. Slots come in pages of page_slots, inside a page each field is stored
+// contiguously and 64 byte aligned, so the compare loops stream through memory instead of chasing per set allocations.
+// Pages never move once allocated, which lets the arena grow while other threads fill or read slots it already has.
+class CuttleSignatureArena {
+public:
+	static constexpr size_t hist_size = 3 * 256;
+	static constexpr size_t page_bits = 10, page_slots = size_t {1} << page_bits;
+	static constexpr size_t max_pages = size_t {1} << 16;
+	using ImageHash = std::array<uint8_t, 64>;
+	
+	CuttleSignatureArena() = default;
+	~CuttleSignatureArena();
+	void reset(size_t count, uint_fast16_t res);
+	void resize(size_t count); // only grows, thread safe and keeps every existing slot in place
+	void clear();
+	void copy(uint_fast32_t dst, uint_fast32_t src);
+	void derive(uint_fast32_t id); // the perceptual hash and the cascade levels, from the grid and the histograms
+	
+	inline uint_fast16_t getRes() const { return res; }
+	inline size_t getCount() const { return count.load(std::memory_order_acquire); }
+	inline size_t getGridSize() const { return grid_size; }
+	
+	// planar R, G, B, res * res bytes each
+	inline uint8_t * grid(uint_fast32_t id) { return page(id).grids.get() + slot(id) * grid_stride; }
+	inline uint8_t const * grid(uint_fast32_t id) const { return page(id).grids.get() + slot(id) * grid_stride; }
+	// square roots of the L1 normalized 256 bin r, g, b histograms, Bhattacharyya coefficients become dot products
+	inline float * hist(uint_fast32_t id) { return page(id).hists.get() + slot(id) * hist_size; }
+	inline float const * hist(uint_fast32_t id) const { return page(id).hists.get() + slot(id) * hist_size; }
+	// coarse levels for the compare cascade: planar channel sums over a 4x4 and 8x8 partition, square roots of 16 bin histograms
+	inline uint32_t const * grid4(uint_fast32_t id) const { return page(id).grids_4.get() + slot(id) * 48; }
+	inline uint32_t const * grid8(uint_fast32_t id) const { return page(id).grids_8.get() + slot(id) * 192; }
+	inline float const * hist16(uint_fast32_t id) const { return page(id).hists_16.get() + slot(id) * 48; }
+	inline ImageHash & imageHash(uint_fast32_t id) { return page(id).image_hashes.get()[slot(id)]; }
+	inline ImageHash const & imageHash(uint_fast32_t id) const { return page(id).image_hashes.get()[slot(id)]; }
+	inline uint64_t phash(uint_fast32_t id) const { return page(id).phashes.get()[slot(id)]; } // 64 bit difference hash of the grid luma
+	
+	double comparePix(uint_fast32_t A, uint_fast32_t B) const;
+	double compareHist(uint_fast32_t A, uint_fast32_t B) const;
+private:
+	struct aligned_free { inline void operator () (void * ptr) const { std::free(ptr); } };
+	template <typename T> using buffer = std::unique_ptr<T[], aligned_free>;
+	template <typename T> static buffer<T> allocate(size_t count);
+	
+	struct Page {
+		buffer<uint8_t> grids;
+		buffer<float> hists;
+		buffer<uint32_t> grids_4, grids_8;
+		buffer<float> hists_16;
+		buffer<ImageHash> image_hashes;
+		buffer<uint64_t> phashes;
+	};
+	
+	static inline size_t slot(uint_fast32_t id) { return id & (page_slots - 1); }
+	inline Page & page(uint_fast32_t id) const { return *pages[id >> page_bits].load(std::memory_order_acquire); }
+	
+	uint_fast16_t res = 0;
+	std::atomic_size_t count {0};
+	size_t grid_size = 0, grid_stride = 0;
+	std::mutex grow_lk;
+	std::unique_ptr<std::atomic<Page *>[]> pages {};
+	size_t page_count = 0;
+};
 
 //--------------------------------
 
 struct CuttleSet {
 	CuttleSet(QString const & filename) : filename(filename), fi(filename) {}
 	QImage getImage() const;
-	void generate(uint_fast16_t res);
+	QImage getImageReduced(uint_fast16_t res, QByteArray const * encoded = nullptr, CuttleBudget::Lease * lease = nullptr) const;
+	// fills the slot of id at the arena resolution, from encoded when the bytes were already read; admitted when the caller
+	// already holds a budget lease covering the decode
+	void generate(CuttleSignatureArena & sigs, QByteArray const * encoded = nullptr, bool admitted = false);
 	QString filename;
 	uint_fast32_t group = 0;
 	uint_fast32_t id = 0;
-	uint_fast16_t res = 0;
+	uint_fast16_t res = 0; // resolution of the signature in the arena, 0 until one is built
 	bool delete_me = false;
-	std::vector<QColor> data {};
-	QPixmap thumb;
+	QImage thumb; // QImage rather than QPixmap, signatures are built off the GUI thread and in headless mode
 	QFileInfo fi;
 	QSize img_size {0, 0};
-	QByteArray img_hash;
-	cv::Mat b_hist, g_hist, r_hist;
+	uint64_t file_hash = 0; // content hash of the file, computed while its bytes are read for decoding
 	inline QSize get_size() const {
 		if (img_size == QSize {0, 0}) getImage();
 		return img_size;
 	}
-	static CuttleMatchData compare(CuttleSet const * A, CuttleSet const * B);
-	static double compare_pix(CuttleSet const * A, CuttleSet const * B);
-	static double compare_hist(CuttleSet const * A, CuttleSet const * B);
+	void copySignature(CuttleSet const & other, CuttleSignatureArena & sigs);
+	// pairs that cannot reach floor are rejected early and reported as invalid_match
+	static CuttleMatchData compare(CuttleSignatureArena const & sigs, CuttleSet const * A, CuttleSet const * B, double floor = 0);
+};
+
+//--------------------------------
+
+class CuttleCache {
+public:
+	CuttleCache() = default;
+	
+	bool load(QString const & path);
+	bool save(QString const & path);
+	bool restore(CuttleSet & set, CuttleSignatureArena & sigs) const;
+	bool restoreFileHash(CuttleSet & set) const;
+	void store(CuttleSet const & set, CuttleSignatureArena const & sigs);
+	// files that are no image are remembered as entries without a signature, until their size or modification time changes
+	bool isFailure(QFileInfo const & fi) const;
+	void storeFailure(CuttleSet const & set);
+	// Entries looked up by restore() count as listed. Once a run has listed its roots completely, the entries below them
+	// that were not looked up belong to files that were deleted or moved away.
+	void beginListing();
+	void evictUnlisted(QList<CuttleDirectory> const & roots);
+	inline bool isDirty() const { return dirty; }
+	
+	static QString defaultPath();
+private:
+	struct Entry {
+		qint64 size;
+		qint64 mtime;
+		quint16 res;
+		quint64 file_hash;
+		QByteArray signature;
+	};
+	static QByteArray serialize(CuttleSet const & set, CuttleSignatureArena const & sigs);
+	static bool deserialize(QByteArray const & data, CuttleSet & set, CuttleSignatureArena & sigs);
+	
+	QHash<QString, Entry> entries {};
+	mutable rw_spinlock lk;
+	mutable std::mutex listed_lk;
+	mutable QSet<QString> listed {};
+	bool dirty = false;
+};
+
+// multi-index hashing over 4 16 bit chunks of the perceptual hash,
+// two hashes within radius r share at least one chunk within r / 4 so only those buckets are probed
+class CuttleHashIndex {
+public:
+	CuttleHashIndex() = default;
+	void build(std::vector<uint64_t> && hashes, unsigned radius);
+	
+	// calls func(j) once for every j > i whose hash is within the radius of hash i
+	template <typename F> void query(size_t i, F && func) const {
+		uint64_t const h = hashes[i];
+		for (unsigned c = 0; c < 4; c++) {
+			uint16_t const key = chunk(h, c);
+			for (uint16_t mask : masks) {
+				uint16_t const probe = key ^ mask;
+				for (uint32_t k = offsets[c][probe]; k < offsets[c][probe + 1]; k++) {
+					uint32_t j = ids[c][k];
+					if (j <= i) continue;
+					uint64_t const o = hashes[j];
+					if (static_cast<unsigned>(__builtin_popcountll(h ^ o)) > radius) continue;
+					// only report from the first chunk that is within the chunk radius so every pair is seen once
+					bool first = true;
+					for (unsigned p = 0; p < c && first; p++) first = static_cast<unsigned>(__builtin_popcount(chunk(h, p) ^ chunk(o, p))) > radius / 4;
+					if (first) func(j);
+				}
+			}
+		}
+	}
+	
+	inline size_t size() const { return hashes.size(); }
+private:
+	static inline uint16_t chunk(uint64_t h, unsigned c) { return h >> (c * 16); }
+	
+	unsigned radius = 0;
+	std::vector<uint64_t> hashes {};
+	std::vector<uint16_t> masks {};
+	std::vector<uint32_t> offsets[4] {};
+	std::vector<uint32_t> ids[4] {};
+};
+
+// vantage point tree over fixed dimension float points with euclidean distance
+class CuttleVPTree {
+public:
+	CuttleVPTree() = default;
+	void build(std::vector<float> && points, size_t dims);
+	// the k nearest points to point i, i excluded, restricted to points accept returns true for, nearest first
+	void query(size_t i, size_t k, std::function<bool(uint32_t)> const & accept, std::vector<uint32_t> & out) const;
+	inline size_t size() const { return dims ? points.size() / dims : 0; }
+private:
+	struct Node {
+		uint32_t point;
+		float mu;
+		int32_t inside, outside;
+	};
+	int32_t build(uint32_t * begin, uint32_t * end, std::vector<float> & scratch);
+	float distance(size_t a, size_t b) const;
+	
+	size_t dims = 0;
+	std::vector<float> points {};
+	std::vector<Node> nodes {};
+};
+
+//--------------------------------
+
+// Sets ordered by their best match and pairs ordered by score, so a threshold selects a prefix by binary search.
+// Built from the match store once the deltas are done; removals only revisit the sets they touch.
+class CuttleRanking {
+public:
+	struct Entry {
+		uint16_t score;
+		uint32_t id;
+	};
+	
+	CuttleRanking() = default;
+	
+	// live is indexed by set id, nullptr for sets that are gone
+	void build(CuttleMatchStore const & store, std::vector<CuttleSet const *> const & live);
+	// refreshes the given sets after they joined or left live, or gained or lost pairs in the store
+	void update(CuttleMatchStore const & store, std::vector<CuttleSet const *> const & live, std::vector<uint32_t> const & touched);
+	void clear();
+	
+	inline uint16_t getBest(uint_fast32_t id) const { return id < best.size() ? best[id] : 0; }
+	inline std::vector<Entry> const & getSets() const { return sets; }
+	inline std::vector<CuttleMatchStore::Edge> const & getEdges() const { return edges; }
+	// lengths of the prefixes scoring at least score
+	size_t setsAbove(uint16_t score) const;
+	size_t edgesAbove(uint16_t score) const;
+	// connected components over the pairs scoring at least score, ordered by their strongest pair, members by their best
+	// match; sets without such a pair are left out
+	std::vector<std::vector<uint32_t>> clusters(uint16_t score) const;
+private:
+	static bool live_pair(std::vector<CuttleSet const *> const & live, uint_fast32_t A, uint_fast32_t B);
+	uint16_t best_of(CuttleMatchStore const & store, std::vector<CuttleSet const *> const & live, uint_fast32_t id) const;
+	
+	std::vector<uint16_t> best {};
+	std::vector<Entry> sets {};
+	std::vector<CuttleMatchStore::Edge> edges {};
+};
+
+//--------------------------------
+
+// figures of the last full run for benchmarking, read once finished has been emitted
+struct CuttleRunStats {
+	double discovery_seconds = 0; // until the walkers had listed every directory, loading overlaps this
+	size_t files = 0;
+	uint_fast64_t pairs_compared = 0; // scored by the search mode, pairs skipped by group or never proposed are not counted
+};
+
+//--------------------------------
+
+struct CuttleMatchPair {
+	CuttleSet const * A;
+	CuttleSet const * B;
+	CuttleMatchData data;
 };
 
 //--------------------------------
@@ -112,34 +419,91 @@ public:
 	CuttleProcessor(QObject * parent);
 	~CuttleProcessor();
 	
+	// Pairs below the floor are neither stored nor fully scored, the compare cascade gives up on them at the coarse levels.
+	// It sits a little under the UI's default threshold of 0.85 so the threshold can still be lowered without a new run.
+	static constexpr double default_match_floor = 0.75;
+	
 	void beginProcessing(QList<CuttleDirectory> const & dirs, size_t res);
 	inline void stop() {worker_run.store(false);}
-	inline std::vector<CuttleSet> const & getSets() const { return sets; }
+	// a deque so sets admitted by a watch mode rescan never move the ones the lists point at
+	inline std::deque<CuttleSet> const & getSets() const { return sets; }
+	inline CuttleSignatureArena const & getSignatures() const { return signatures; }
+	inline CuttleRunStats const & getRunStats() const { return run_stats; }
 	double getHigh(CuttleSet const * set) const;
+	uint16_t getHighScore(CuttleSet const * set) const;
 	std::vector<CuttleSet const *> getSetsAboveThresh(double high) const;
 	std::vector<CuttleSet const *> getSetsAboveThresh(CuttleSet const * comp, double thresh) const;
+	std::vector<CuttleMatchPair> getPairsAboveThresh(double thresh) const;
+	std::vector<std::vector<CuttleSet const *>> getClustersAboveThresh(double thresh) const;
 	void remove(CuttleSet const * set);
 	void remove(CuttleSet const * setA, CuttleSet const * setB);
 	void remove_all_idential();
+	inline void setCachePath(QString const & path) { cache_path = path; cache_loaded = false; }
+	inline void setMatchFloor(double floor) { match_floor = floor; }
+	inline void setMatchTopK(uint_fast32_t k) { match_top_k = k; }
+	inline void setSearchMode(CuttleSearchMode mode) { search_mode = mode; }
+	inline void setPhashRadius(unsigned radius) { phash_radius = std::min(radius, 64u); }
+	inline void setHistogramNeighbours(unsigned k) { hist_neighbours = std::max(k, 1u); }
+	// keeps watching the roots of the last run, changes are rescanned incrementally instead of starting over
+	void setWatch(bool watch);
 	inline CuttleMatchData const & getMatchData(CuttleSet const * A, CuttleSet const * B) const {
+		if (A->delete_me || B->delete_me) return invalid_match;
 		if (A->group && B->group && A->group == B->group) return invalid_match;
 		if (A->id == B->id) return perfect_match;
-		if (A->id > B->id) return match_data_fast[A->id][B->id];
-		else return match_data_fast[B->id][A->id];
+		return matches.get(A->id, B->id);
 	}
 	inline CuttleMatchData const & getMatchData(CuttleSet const & A, CuttleSet const & B) const {
-		if (A.group && B.group && A.group == B.group) return invalid_match;
-		if (A.id == B.id) return perfect_match;
-		if (A.id > B.id) return match_data_fast[A.id][B.id];
-		else return match_data_fast[B.id][A.id];
+		return getMatchData(&A, &B);
 	}
 protected:
-	std::vector<CuttleSet> sets {};
-	uint_fast32_t match_data_size = 0;
-	CuttleMatchData * * match_data_fast = nullptr;
+	std::deque<CuttleSet> sets {};
+	std::vector<CuttleSet const *> sets_by_id {};
+	CuttleSignatureArena signatures {};
+	CuttleMatchStore matches {};
+	CuttleRanking ranking {};
+	CuttleRunStats run_stats {};
+	double match_floor = default_match_floor;
+	uint_fast32_t match_top_k = 64;
+	CuttleSearchMode search_mode = CuttleSearchMode::exhaustive;
+	unsigned phash_radius = 12;
+	unsigned hist_neighbours = 16;
+	CuttleCache cache {};
+	QString cache_path = CuttleCache::defaultPath();
+	bool cache_loaded = false;
 private:
+	void rebuildIndex();
+	bool comparePair(CuttleSet const * A, CuttleSet const * B, std::vector<CuttleMatchStore::Edge> & edges) const;
+	// each returns the number of pairs it scored
+	uint_fast64_t compareAll(std::function<void(int)> const & progress);
+	uint_fast64_t compareHashCandidates(std::function<void(int)> const & progress);
+	uint_fast64_t compareHistogramNeighbours(std::function<void(int)> const & progress);
+	void watchTree(QStringList const & added, QStringList const & gone);
+	void rescan();
+	void rescanAdmit(uint_fast32_t gen, std::vector<std::pair<QString, uint_fast32_t>> added, std::vector<uint32_t> removed, QStringList new_dirs, QStringList gone_dirs);
+	// a file a rescan loaded, as it was on disk right before it was read
+	struct settling_t {
+		QString filename;
+		qint64 size;
+		qint64 mtime;
+		std::chrono::steady_clock::time_point since;
+	};
+	void rescanFinish(uint_fast32_t gen, std::vector<CuttleSet *> added, std::vector<CuttleSet *> dropped, std::vector<CuttleMatchStore::Edge> edges, std::vector<settling_t> loaded);
+	void settle();
 	std::atomic_bool worker_run {false};
-	std::thread * worker = nullptr;
+	std::future<void> worker {};
+	// watch mode, only touched on the thread the processor lives on
+	QFileSystemWatcher * watcher = nullptr;
+	QTimer * rescan_timer = nullptr;
+	QTimer * settle_timer = nullptr;
+	std::vector<settling_t> settling {}; // checked again once they should have been written completely
+	QSet<QString> dirty_dirs {};
+	QSet<QString> tree_dirs {}; // every directory under the roots, as listed by the run and kept current by rescans
+	QList<CuttleDirectory> roots {}; // of the last run
+	uint_fast16_t roots_res = 0;
+	bool watch = false;
+	bool rescan_busy = false;
+	uint_fast32_t generation = 0; // bumped by every full run, stale rescan stages check it and drop their results
+	std::chrono::steady_clock::time_point cache_saved {}; // rescans save at most once per cache_save_interval, only touched by the worker
 signals:
 	void started();
 	//--- PROGRESS BAR STUFF
@@ -148,39 +512,46 @@ signals:
 	void value(int);
 	//---
 	void finished();
+	// a watch mode rescan admitted and tombstoned sets, emitted on the processor's thread once the matches are merged
+	void updated(std::vector<uint32_t> const & added, std::vector<uint32_t> const & removed);
 };
 
 //================================
 //--------------------------------
 //================================
 
-class CuttleLeftItem : public QFrame {
+// Rows of the left and right columns, the sets in display order each with the value shown next to it. The list views
+// only ask for the rows they paint, so the cost of a column no longer grows with the number of matches.
+class CuttleSetModel : public QAbstractListModel {
 	Q_OBJECT
 public:
-	CuttleSet const * set;
-	CuttleLeftItem(QWidget * parent, CuttleSet const *, CuttleProcessor *);
-	inline double getHigh() const { return high; }
+	enum Role {
+		SetRole = Qt::UserRole, // CuttleSet const * as a void pointer
+		ValueRole,
+		ValueTextRole,
+	};
+	
+	CuttleSetModel(QObject * parent, QString const & value_format);
+	int rowCount(QModelIndex const & parent = {}) const override;
+	QVariant data(QModelIndex const & index, int role = Qt::DisplayRole) const override;
+	
+	void assign(std::vector<CuttleSet const *> && sets, std::function<double(CuttleSet const *)> const & value);
+	void clear();
+	inline CuttleSet const * setAt(int row) const { return row >= 0 && static_cast<size_t>(row) < rows.size() ? rows[row] : nullptr; }
+	int rowOf(CuttleSet const * set) const; // -1 when not listed
 private:
-	void * token;
-	CuttleProcessor * proc = nullptr;
-	double high;
-signals:
-	void activated(CuttleSet const * _this);
-	void recalculateHigh();
-public slots:
-	void activate();
+	QString value_format;
+	std::vector<CuttleSet const *> rows {};
+	std::vector<double> values {};
 };
 
-class CuttleRightItem : public QFrame {
+// paints a row as the old item frames looked: the elided file name above the thumbnail and the value
+class CuttleSetDelegate : public QStyledItemDelegate {
 	Q_OBJECT
 public:
-	CuttleSet const * set;
-	CuttleRightItem(QWidget * parent, CuttleSet const * set, CuttleSet const * other, CuttleProcessor * proc);
-	inline double getValue() const { return value; }
-private:
-	double value;
-signals:
-	void activated(CuttleSet const * _this);
+	CuttleSetDelegate(QObject * parent) : QStyledItemDelegate(parent) {}
+	void paint(QPainter * painter, QStyleOptionViewItem const & option, QModelIndex const & index) const override;
+	QSize sizeHint(QStyleOptionViewItem const & option, QModelIndex const & index) const override;
 };
 
 struct CuttleCompInfo {
@@ -193,7 +564,7 @@ struct CuttleCompInfo {
 	status size;
 	status dims;
 	status date;
-	static void GetCompInfo(CuttleSet const * A, CuttleSet const * B, CuttleCompInfo & Ac, CuttleCompInfo & Ab);
+	static void GetCompInfo(CuttleSignatureArena const & sigs, CuttleSet const * A, CuttleSet const * B, CuttleCompInfo & Ac, CuttleCompInfo & Ab);
 };
 
 class CuttleCompItem : public QFrame {
@@ -209,6 +580,52 @@ signals:
 
 //--------------------------------
 
+// Decoded full resolution images for the compare view, keyed by file name. Past the byte budget the least recently used
+// images are dropped, except the two last asked for. A get for an image that is still being prefetched waits for that
+// decode rather than starting another.
+class CuttleImageCache {
+public:
+	static constexpr size_t default_budget = size_t {512} << 20;
+	
+	CuttleImageCache(size_t budget = default_budget) : budget(budget) {}
+	~CuttleImageCache(); // waits for running prefetches
+	
+	QImage get(CuttleSet const * set);
+	void prefetch(CuttleSet const * set); // decodes on the pool, does nothing when the image is cached or on its way
+	void forget(QString const & filename);
+	void clear();
+	void setBudget(size_t bytes);
+private:
+	// a prefetch queued on the pool, whoever claims it first decodes
+	struct Pending {
+		std::atomic_bool claimed {false};
+		std::function<void()> decode;
+	};
+	struct Entry {
+		std::shared_future<QImage> image;
+		size_t bytes; // 0 until decoded
+		uint64_t ticket; // tells a finished decode whether its entry is still the one it was started for
+		std::list<QString>::iterator lru;
+		std::shared_ptr<Pending> pending; // null for images decoded on the requesting thread
+	};
+	std::shared_future<QImage> request(QString const & filename, bool background);
+	void admit(QString const & filename, uint64_t ticket, QImage const & image);
+	void evict();
+	void drop(QHash<QString, Entry>::iterator iter);
+	
+	std::mutex lk;
+	std::condition_variable idle;
+	QHash<QString, Entry> entries {};
+	std::list<QString> lru {}; // most recent first
+	std::array<QString, 2> shown {}; // the pair on screen, never evicted
+	size_t budget;
+	size_t used = 0;
+	uint64_t next_ticket = 0;
+	size_t running = 0;
+};
+
+//--------------------------------
+
 class CuttleCore : public QMainWindow {
 	Q_OBJECT
 public: 
@@ -221,8 +638,11 @@ private:
 	CuttleBuilder * builder = nullptr;
 	CuttleProcessor * processor = nullptr;
 	ImageView * view = nullptr;
-	QList<CuttleLeftItem *> leftList {};
-	QList<CuttleRightItem *> rightList {};
+	CuttleSetModel * leftModel = nullptr;
+	CuttleSetModel * rightModel = nullptr;
+	CuttleSet const * active = nullptr; // the set chosen on the left
+	CuttleSet const * compared = nullptr; // the set chosen on the right
+	CuttleImageCache images {};
 	
 	CuttleCompItem * cItemL = nullptr;
 	CuttleCompItem * cItemR = nullptr;
@@ -232,3 +652,6 @@ private:
 //================================
 //--------------------------------
 //================================
+
+// headless entry point, runs the processor and writes matched pairs to stdout
+int cuttle_batch(int argc, char * * argv);
@@ -0,0 +1,133 @@
+#include "cuttle.hh"
+
+#include "cuttlesimd.hh"
+
+#include <cstdlib>
+#include <cstring>
+#include <ctgmath>
+
+static constexpr size_t arena_align = 64;
+
+template <typename T> CuttleSignatureArena::buffer<T> CuttleSignatureArena::allocate(size_t count) {
+	size_t bytes = (std::max<size_t>(count * sizeof(T), 1) + arena_align - 1) / arena_align * arena_align;
+	T * ptr = static_cast<T *>(std::aligned_alloc(arena_align, bytes));
+	if (!ptr) throw std::bad_alloc {};
+	std::memset(static_cast<void *>(ptr), 0, bytes);
+	return buffer<T> {ptr};
+}
+
+CuttleSignatureArena::~CuttleSignatureArena() {
+	clear();
+}
+
+void CuttleSignatureArena::reset(size_t count, uint_fast16_t res) {
+	clear();
+	this->res = res;
+	grid_size = static_cast<size_t>(res) * res * 3;
+	grid_stride = (grid_size + arena_align - 1) / arena_align * arena_align;
+	resize(count);
+}
+
+void CuttleSignatureArena::resize(size_t count) {
+	std::lock_guard<std::mutex> guard {grow_lk};
+	if (count <= this->count.load(std::memory_order_relaxed)) return;
+	if (!pages) pages.reset(new std::atomic<Page *>[max_pages] {});
+	size_t const needed = (count + page_slots - 1) >> page_bits;
+	if (needed > max_pages) throw std::length_error {"signature arena is full"};
+	for (; page_count < needed; page_count++) {
+		pages[page_count].store(new Page {
+			allocate<uint8_t>(page_slots * grid_stride),
+			allocate<float>(page_slots * hist_size),
+			allocate<uint32_t>(page_slots * 48),
+			allocate<uint32_t>(page_slots * 192),
+			allocate<float>(page_slots * 48),
+			allocate<ImageHash>(page_slots),
+			allocate<uint64_t>(page_slots),
+		}, std::memory_order_release);
+	}
+	this->count.store(count, std::memory_order_release);
+}
+
+void CuttleSignatureArena::clear() {
+	std::lock_guard<std::mutex> guard {grow_lk};
+	for (size_t i = 0; i < page_count; i++) delete pages[i].exchange(nullptr);
+	page_count = 0;
+	res = 0;
+	count.store(0);
+	grid_size = grid_stride = 0;
+}
+
+void CuttleSignatureArena::copy(uint_fast32_t dst, uint_fast32_t src) {
+	Page & d = page(dst), & s = page(src);
+	std::memcpy(grid(dst), grid(src), grid_size);
+	std::memcpy(hist(dst), hist(src), hist_size * sizeof(float));
+	std::memcpy(d.grids_4.get() + slot(dst) * 48, grid4(src), 48 * sizeof(uint32_t));
+	std::memcpy(d.grids_8.get() + slot(dst) * 192, grid8(src), 192 * sizeof(uint32_t));
+	std::memcpy(d.hists_16.get() + slot(dst) * 48, hist16(src), 48 * sizeof(float));
+	d.image_hashes.get()[slot(dst)] = s.image_hashes.get()[slot(src)];
+	d.phashes.get()[slot(dst)] = s.phashes.get()[slot(src)];
+}
+
+void CuttleSignatureArena::derive(uint_fast32_t id) {
+	size_t const plane = static_cast<size_t>(res) * res;
+	Page & pg = page(id);
+	uint8_t const * const data = grid(id);
+	uint32_t * const g4 = pg.grids_4.get() + slot(id) * 48;
+	uint32_t * const g8 = pg.grids_8.get() + slot(id) * 192;
+	float * const h16 = pg.hists_16.get() + slot(id) * 48;
+	uint64_t & phash = pg.phashes.get()[slot(id)];
+	std::fill(g4, g4 + 48, 0);
+	std::fill(g8, g8 + 192, 0);
+	std::fill(h16, h16 + 48, 0.0f);
+	phash = 0;
+	if (!res) return;
+	
+	uint8_t const * p = data;
+	for (size_t c = 0; c < 3; c++) for (uint_fast16_t y = 0; y < res; y++) for (uint_fast16_t x = 0; x < res; x++) {
+		uint8_t v = *p++;
+		g4[c * 16 + (y * 4 / res) * 4 + x * 4 / res] += v;
+		g8[c * 64 + (y * 8 / res) * 8 + x * 8 / res] += v;
+	}
+	
+	// merging bins sums the histogram mass, the stored values are its square roots
+	float const * h = hist(id);
+	for (size_t c = 0; c < 3; c++) for (size_t b = 0; b < 256; b++) h16[c * 16 + b / 16] += h[c * 256 + b] * h[c * 256 + b];
+	for (size_t i = 0; i < 48; i++) h16[i] = std::sqrt(h16[i]);
+	
+	// dHash: the luma grid is box filtered down to 9x8 and every bit records whether a cell is darker than its right neighbour
+	float luma[8][9];
+	for (uint_fast16_t r = 0; r < 8; r++) {
+		uint_fast16_t y0 = r * res / 8, y1 = std::max<uint_fast16_t>(y0 + 1, (r + 1) * res / 8);
+		for (uint_fast16_t c = 0; c < 9; c++) {
+			uint_fast16_t x0 = c * res / 9, x1 = std::max<uint_fast16_t>(x0 + 1, (c + 1) * res / 9);
+			uint_fast32_t sum = 0;
+			for (uint_fast16_t y = y0; y < y1; y++) for (uint_fast16_t x = x0; x < x1; x++) {
+				size_t i = y * res + x;
+				sum += data[i] * 299u + data[plane + i] * 587u + data[plane * 2 + i] * 114u;
+			}
+			luma[r][c] = static_cast<float>(sum) / ((y1 - y0) * (x1 - x0));
+		}
+	}
+	
+	for (uint_fast16_t r = 0; r < 8; r++) for (uint_fast16_t c = 0; c < 8; c++) {
+		if (luma[r][c] < luma[r][c + 1]) phash |= uint64_t {1} << (r * 8 + c);
+	}
+}
+
+double CuttleSignatureArena::comparePix(uint_fast32_t A, uint_fast32_t B) const {
+	if (!grid_size) return 0;
+	uint64_t sad = sad_u8(grid(A), grid(B), grid_size);
+	return 1.0 - static_cast<double>(sad) / (255.0 * grid_size);
+}
+
+// Bhattacharyya distance per channel as OpenCV computes it for L1 normalized histograms, the worst channel decides
+double CuttleSignatureArena::compareHist(uint_fast32_t A, uint_fast32_t B) const {
+	float const * hA = hist(A), * hB = hist(B);
+	double sH = 0;
+	for (size_t c = 0; c < 3; c++) {
+		float bc = 0;
+		for (size_t i = 0; i < 256; i++) bc += hA[c * 256 + i] * hB[c * 256 + i];
+		sH = std::max(sH, std::sqrt(std::max(0.0, 1.0 - bc)));
+	}
+	return 1 - sH;
+}
@@ -0,0 +1,137 @@
+#include "cuttle.hh"
+
+#include "cuttlebudget.hh"
+#include "cuttlepool.hh"
+#include "cuttletrace.hh"
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTextStream>
+
+#include <cstdio>
+
+static QString csv_quote(QString str) {
+	str.replace('"', "\"\"");
+	return QChar('"') + str + QChar('"');
+}
+
+int cuttle_batch(int argc, char * * argv) {
+	QCoreApplication app {argc, argv};
+	QCoreApplication::setApplicationName("cuttlefish");
+	
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Find duplicate and near duplicate images without a display.");
+	parser.addHelpOption();
+	parser.addPositionalArgument("directories", "Directories to scan, each one forms its own group when more than one is given.", "<dir>...");
+	QCommandLineOption batchOpt {{"b", "batch"}, "Run headless."};
+	QCommandLineOption resOpt {{"r", "res"}, "Signature resolution.", "n", "32"};
+	QCommandLineOption threshOpt {{"t", "threshold"}, "Minimum match value to report.", "value", "0.85"};
+	QCommandLineOption threadsOpt {{"j", "threads"}, "Worker thread count, 0 uses every core.", "n", "0"};
+	QCommandLineOption formatOpt {{"f", "format"}, "Output format, json (one object per line) or csv.", "format", "json"};
+	QCommandLineOption floorOpt {"floor", "Lowest match value kept in memory.", "value", QString::number(CuttleProcessor::default_match_floor)};
+	QCommandLineOption topKOpt {"top-k", "Matches kept per image, 0 keeps every match above the floor.", "n", "64"};
+	QCommandLineOption flatOpt {"no-recursive", "Do not descend into subdirectories."};
+	QCommandLineOption cacheOpt {"cache", "Signature cache file.", "path", CuttleCache::defaultPath()};
+	QCommandLineOption noCacheOpt {"no-cache", "Do not read or write the signature cache."};
+	QCommandLineOption searchOpt {{"s", "search"}, "Pair search, exhaustive, phash or histogram.", "mode", "exhaustive"};
+	QCommandLineOption radiusOpt {"radius", "Perceptual hash Hamming radius for the phash search.", "bits", "12"};
+	QCommandLineOption neighboursOpt {"neighbours", "Histogram neighbours scored per image for the histogram search.", "k", "16"};
+	QCommandLineOption clustersOpt {"clusters", "Report groups of connected matches above the threshold instead of pairs."};
+	QCommandLineOption budgetOpt {"decode-budget", "Megabytes of decoded pixels held at once across all threads.", "MB", "1024"};
+	QCommandLineOption traceOpt {"trace", "Write a Chrome trace (chrome://tracing, Perfetto) to this file.", "path"};
+	parser.addOptions({batchOpt, resOpt, threshOpt, threadsOpt, formatOpt, floorOpt, topKOpt, flatOpt, cacheOpt, noCacheOpt, searchOpt, radiusOpt, neighboursOpt, clustersOpt, budgetOpt, traceOpt});
+	parser.process(app);
+	if (parser.isSet(traceOpt)) CuttleTrace::enable(parser.value(traceOpt));
+	
+	QList<CuttleDirectory> dirs {};
+	for (QString const & dir : parser.positionalArguments()) {
+		if (!QDir{dir}.exists()) {
+			fprintf(stderr, "not a directory: %s\n", qPrintable(dir));
+			return 1;
+		}
+		dirs.append({dir, !parser.isSet(flatOpt)});
+	}
+	if (dirs.isEmpty()) parser.showHelp(1);
+	
+	bool csv = parser.value(formatOpt) == "csv";
+	bool clusters = parser.isSet(clustersOpt);
+	if (!csv && parser.value(formatOpt) != "json") {
+		fprintf(stderr, "unknown format: %s\n", qPrintable(parser.value(formatOpt)));
+		return 1;
+	}
+	
+	CuttleSearchMode search;
+	if (parser.value(searchOpt) == "exhaustive") search = CuttleSearchMode::exhaustive;
+	else if (parser.value(searchOpt) == "phash") search = CuttleSearchMode::phash;
+	else if (parser.value(searchOpt) == "histogram") search = CuttleSearchMode::histogram;
+	else {
+		fprintf(stderr, "unknown search mode: %s\n", qPrintable(parser.value(searchOpt)));
+		return 1;
+	}
+	
+	size_t res = std::max(1u, parser.value(resOpt).toUInt());
+	double thresh = parser.value(threshOpt).toDouble();
+	CuttlePool::instance().setThreadCount(parser.value(threadsOpt).toUInt());
+	CuttleBudget::instance().setLimit(static_cast<size_t>(parser.value(budgetOpt).toULongLong()) << 20);
+	
+	CuttleProcessor processor {nullptr};
+	processor.setMatchFloor(std::min(thresh, parser.value(floorOpt).toDouble()));
+	processor.setMatchTopK(parser.value(topKOpt).toUInt());
+	processor.setSearchMode(search);
+	processor.setPhashRadius(parser.value(radiusOpt).toUInt());
+	processor.setHistogramNeighbours(parser.value(neighboursOpt).toUInt());
+	processor.setCachePath(parser.isSet(noCacheOpt) ? QString {} : parser.value(cacheOpt));
+	
+	QObject::connect(&processor, &CuttleProcessor::section, [](QString str){
+		fprintf(stderr, "%s\n", qPrintable(str.remove(" %p%")));
+	});
+	
+	QObject::connect(&processor, &CuttleProcessor::finished, &app, [&](){
+		QTextStream out {stdout};
+		if (clusters) {
+			if (csv) out << "cluster,file\n";
+			int index = 0;
+			for (auto const & cluster : processor.getClustersAboveThresh(thresh)) {
+				if (csv) {
+					for (CuttleSet const * set : cluster) out << index << ',' << csv_quote(set->filename) << '\n';
+				} else {
+					QJsonArray files {};
+					for (CuttleSet const * set : cluster) files.append(set->filename);
+					QJsonObject obj {
+						{"cluster", index},
+						{"files", files},
+					};
+					out << QJsonDocument {obj}.toJson(QJsonDocument::Compact) << '\n';
+				}
+				index++;
+			}
+			out.flush();
+			app.quit();
+			return;
+		}
+		if (csv) out << "a,b,value,identical\n";
+		for (CuttleMatchPair const & pair : processor.getPairsAboveThresh(thresh)) {
+			if (csv) {
+				out << csv_quote(pair.A->filename) << ',' << csv_quote(pair.B->filename) << ',' << pair.data.value() << ',' << (pair.data.identical() ? "true" : "false") << '\n';
+			} else {
+				QJsonObject obj {
+					{"a", pair.A->filename},
+					{"b", pair.B->filename},
+					{"value", pair.data.value()},
+					{"identical", pair.data.identical()},
+				};
+				out << QJsonDocument {obj}.toJson(QJsonDocument::Compact) << '\n';
+			}
+		}
+		out.flush();
+		app.quit();
+	}, Qt::QueuedConnection);
+	
+	processor.beginProcessing(dirs, res);
+	int ret = app.exec();
+	CuttleTrace::flush();
+	return ret;
+}
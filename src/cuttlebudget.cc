@@ -0,0 +1,55 @@
+#include "cuttlebudget.hh"
+
+#include "cuttletrace.hh"
+
+CuttleBudget & CuttleBudget::instance() {
+	static CuttleBudget budget {};
+	return budget;
+}
+
+void CuttleBudget::setLimit(size_t bytes) {
+	{
+		std::lock_guard<std::mutex> guard {lk};
+		limit = bytes ? bytes : default_limit;
+	}
+	freed.notify_all();
+}
+
+CuttleBudget::Lease CuttleBudget::acquire(size_t bytes) {
+	std::unique_lock<std::mutex> lock {lk};
+	if (bytes > limit) {
+		// admitted alone, and nothing new is admitted while it waits, or a stream of small decodes could starve it
+		CuttleTraceSpan span {"wait for decode budget"};
+		oversized_waiting++;
+		freed.wait(lock, [&](){ return !used; });
+		oversized_waiting--;
+	} else if (oversized_waiting || used + bytes > limit) {
+		CuttleTraceSpan span {"wait for decode budget"};
+		freed.wait(lock, [&](){ return !oversized_waiting && used + bytes <= limit; });
+	}
+	used += bytes;
+	return Lease {this, bytes};
+}
+
+void CuttleBudget::give_back(size_t bytes) {
+	{
+		std::lock_guard<std::mutex> guard {lk};
+		used -= bytes;
+	}
+	freed.notify_all();
+}
+
+CuttleBudget::Lease & CuttleBudget::Lease::operator = (Lease && other) {
+	if (this == &other) return *this;
+	release();
+	owner = other.owner;
+	bytes = other.bytes;
+	other.owner = nullptr;
+	return *this;
+}
+
+void CuttleBudget::Lease::release() {
+	if (!owner) return;
+	owner->give_back(bytes);
+	owner = nullptr;
+}
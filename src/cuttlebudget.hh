@@ -0,0 +1,48 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+
+// process-wide budget for decoded pixels, a decode waits until its estimated footprint fits next to the ones in flight
+class CuttleBudget final {
+public:
+	// returns its bytes to the budget when destroyed
+	class Lease {
+	public:
+		Lease() = default;
+		Lease(Lease && other) : owner(other.owner), bytes(other.bytes) { other.owner = nullptr; }
+		Lease & operator = (Lease && other);
+		Lease(Lease const &) = delete;
+		~Lease() { release(); }
+		void release();
+	private:
+		friend class CuttleBudget;
+		Lease(CuttleBudget * owner, size_t bytes) : owner(owner), bytes(bytes) {}
+		CuttleBudget * owner = nullptr;
+		size_t bytes = 0;
+	};
+	
+	static CuttleBudget & instance();
+	
+	// 0 selects the default, an estimate larger than the whole budget is admitted once nothing else is in flight
+	void setLimit(size_t bytes);
+	inline size_t getLimit() const { return limit; }
+	
+	// blocks until bytes fit, waiters are woken on every release so a small decode is not held up behind a large one that
+	// still fits the budget; one larger than the whole budget holds back every new admission until it got its turn
+	Lease acquire(size_t bytes);
+	
+	static constexpr size_t default_limit = size_t {1} << 30;
+private:
+	CuttleBudget() = default;
+	CuttleBudget(CuttleBudget const &) = delete;
+	
+	void give_back(size_t bytes);
+	
+	std::mutex lk;
+	std::condition_variable freed;
+	size_t limit = default_limit;
+	size_t used = 0;
+	size_t oversized_waiting = 0;
+};
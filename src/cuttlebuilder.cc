@@ -56,6 +56,17 @@ CuttleBuilder::CuttleBuilder(QWidget * parent) : QWidget {parent, Qt::Window} {
 	cacheSpin->setMaximum(65535);
 	gLayout->addWidget(cacheSpin);
 	
+	QComboBox * searchBox = new QComboBox {this};
+	searchBox->addItem("Exhaustive", static_cast<int>(CuttleSearchMode::exhaustive));
+	searchBox->addItem("Perceptual Hash", static_cast<int>(CuttleSearchMode::phash));
+	searchBox->addItem("Histogram Neighbours", static_cast<int>(CuttleSearchMode::histogram));
+	searchBox->setToolTip("Exhaustive scores every pair, the other modes only score likely candidates and scale to much larger collections.");
+	gLayout->addWidget(searchBox);
+	
+	QCheckBox * watchCB = new QCheckBox {"Watch", this};
+	watchCB->setToolTip("Keep watching the directories after the run, new, changed and removed files are picked up as they appear.");
+	gLayout->addWidget(watchCB);
+	
 	QPushButton * goBut = new QPushButton {"Go", this};
 	gLayout->addWidget(goBut);
 	
@@ -67,7 +78,12 @@ CuttleBuilder::CuttleBuilder(QWidget * parent) : QWidget {parent, Qt::Window} {
 		buildView();
 	});
 	
-	connect(goBut, &QPushButton::clicked, this, [=](){emit begin(dirs, cacheSpin->value()); hide();});
+	connect(goBut, &QPushButton::clicked, this, [=](){
+		emit searchMode(static_cast<CuttleSearchMode>(searchBox->currentData().toInt()));
+		emit watch(watchCB->isChecked());
+		emit begin(dirs, cacheSpin->value());
+		hide();
+	});
 	
 	auto args = QApplication::arguments();
 	for (int i = 1; i < args.length(); i++) {
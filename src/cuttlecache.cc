@@ -0,0 +1,200 @@
+#include "cuttle.hh"
+
+#include <QDataStream>
+#include <QFile>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#include <algorithm>
+#include <cstring>
+
+static constexpr quint32 cache_magic = 0x43545446; // CTTF
+static constexpr quint32 cache_version = 6;
+static constexpr qint64 min_entry_bytes = 34; // an empty key and signature, the sizes of both plus the fixed fields
+
+QString CuttleCache::defaultPath() {
+	return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/signatures.bin";
+}
+
+bool CuttleCache::load(QString const & path) {
+	QFile file {path};
+	if (!file.open(QIODevice::ReadOnly)) return false;
+	QDataStream in {&file};
+	in.setVersion(QDataStream::Qt_6_0);
+	
+	quint32 magic, version;
+	in >> magic >> version;
+	if (magic != cache_magic || version != cache_version) return false;
+	
+	quint64 count;
+	in >> count;
+	
+	lk.write_lock();
+	entries.clear();
+	entries.reserve(std::min<quint64>(count, file.size() / min_entry_bytes)); // the count of a damaged file is not trusted
+	for (quint64 i = 0; i < count && in.status() == QDataStream::Ok; i++) {
+		QString key;
+		Entry entry;
+		in >> key >> entry.size >> entry.mtime >> entry.res >> entry.file_hash >> entry.signature;
+		entries.insert(key, std::move(entry));
+	}
+	bool ok = in.status() == QDataStream::Ok;
+	if (!ok) entries.clear();
+	dirty = false;
+	lk.write_unlock();
+	return ok;
+}
+
+bool CuttleCache::save(QString const & path) {
+	QDir {}.mkpath(QFileInfo {path}.absolutePath());
+	QSaveFile file {path};
+	if (!file.open(QIODevice::WriteOnly)) return false;
+	QDataStream out {&file};
+	out.setVersion(QDataStream::Qt_6_0);
+	
+	lk.read_access();
+	out << cache_magic << cache_version << static_cast<quint64>(entries.size());
+	for (auto iter = entries.cbegin(); iter != entries.cend(); iter++) {
+		Entry const & entry = iter.value();
+		out << iter.key() << entry.size << entry.mtime << entry.res << entry.file_hash << entry.signature;
+	}
+	lk.read_done();
+	
+	if (out.status() != QDataStream::Ok || !file.commit()) return false;
+	dirty = false;
+	return true;
+}
+
+bool CuttleCache::restore(CuttleSet & set, CuttleSignatureArena & sigs) const {
+	QString key = set.fi.canonicalFilePath();
+	if (key.isEmpty()) return false;
+	
+	lk.read_access();
+	auto iter = entries.constFind(key);
+	bool hit = iter != entries.cend() && iter->res == sigs.getRes() && iter->size == set.fi.size() && iter->mtime == set.fi.lastModified().toMSecsSinceEpoch();
+	bool const found = iter != entries.cend();
+	QByteArray signature = hit ? iter->signature : QByteArray {};
+	lk.read_done();
+	
+	if (found) {
+		std::lock_guard<std::mutex> guard {listed_lk};
+		listed.insert(key);
+	}
+	if (!hit || !deserialize(signature, set, sigs)) return false;
+	set.res = sigs.getRes();
+	sigs.derive(set.id);
+	return true;
+}
+
+bool CuttleCache::restoreFileHash(CuttleSet & set) const {
+	QString key = set.fi.canonicalFilePath();
+	if (key.isEmpty()) return false;
+	
+	lk.read_access();
+	auto iter = entries.constFind(key);
+	bool hit = iter != entries.cend() && iter->file_hash && iter->size == set.fi.size() && iter->mtime == set.fi.lastModified().toMSecsSinceEpoch();
+	if (hit) set.file_hash = iter->file_hash;
+	lk.read_done();
+	return hit;
+}
+
+void CuttleCache::store(CuttleSet const & set, CuttleSignatureArena const & sigs) {
+	QString key = set.fi.canonicalFilePath();
+	if (key.isEmpty()) return;
+	
+	Entry entry {set.fi.size(), set.fi.lastModified().toMSecsSinceEpoch(), static_cast<quint16>(set.res), set.file_hash, serialize(set, sigs)};
+	
+	lk.write_lock();
+	entries.insert(key, std::move(entry));
+	dirty = true;
+	lk.write_unlock();
+}
+
+bool CuttleCache::isFailure(QFileInfo const & fi) const {
+	QString key = fi.canonicalFilePath();
+	if (key.isEmpty()) return false;
+	
+	lk.read_access();
+	auto iter = entries.constFind(key);
+	bool hit = iter != entries.cend() && iter->signature.isEmpty() && iter->size == fi.size() && iter->mtime == fi.lastModified().toMSecsSinceEpoch();
+	lk.read_done();
+	return hit;
+}
+
+void CuttleCache::storeFailure(CuttleSet const & set) {
+	QString key = set.fi.canonicalFilePath();
+	// permissions can change without touching the modification time, a file that cannot be opened is tried again
+	if (key.isEmpty() || !set.fi.isReadable()) return;
+	
+	Entry entry {set.fi.size(), set.fi.lastModified().toMSecsSinceEpoch(), 0, 0, {}};
+	
+	lk.write_lock();
+	entries.insert(key, std::move(entry));
+	dirty = true;
+	lk.write_unlock();
+}
+
+void CuttleCache::beginListing() {
+	std::lock_guard<std::mutex> guard {listed_lk};
+	listed.clear();
+}
+
+void CuttleCache::evictUnlisted(QList<CuttleDirectory> const & roots) {
+	std::vector<std::pair<QString, bool>> bases {};
+	for (CuttleDirectory const & dir : roots) {
+		QString base = QFileInfo {dir.dir}.canonicalFilePath();
+		if (!base.isEmpty()) bases.emplace_back(base + '/', dir.recursive);
+	}
+	auto below = [&](QString const & key){
+		for (auto const & base : bases) {
+			if (key.startsWith(base.first) && (base.second || key.indexOf('/', base.first.size()) < 0)) return true;
+		}
+		return false;
+	};
+	
+	std::lock_guard<std::mutex> guard {listed_lk};
+	lk.write_lock();
+	for (auto iter = entries.begin(); iter != entries.end();) {
+		if (listed.contains(iter.key()) || !below(iter.key())) iter++;
+		else {
+			iter = entries.erase(iter);
+			dirty = true;
+		}
+	}
+	lk.write_unlock();
+	listed.clear();
+}
+
+template <typename T> static inline void write_raw(QDataStream & out, T const * data, size_t count) {
+	out << QByteArray {reinterpret_cast<char const *>(data), static_cast<qsizetype>(count * sizeof(T))};
+}
+
+template <typename T> static inline bool read_raw(QDataStream & in, T * data, size_t count) {
+	QByteArray bytes;
+	in >> bytes;
+	if (bytes.size() != static_cast<qsizetype>(count * sizeof(T))) return false;
+	memcpy(data, bytes.constData(), bytes.size());
+	return true;
+}
+
+QByteArray CuttleCache::serialize(CuttleSet const & set, CuttleSignatureArena const & sigs) {
+	QByteArray data;
+	QDataStream out {&data, QIODevice::WriteOnly};
+	out.setVersion(QDataStream::Qt_6_0);
+	write_raw(out, sigs.grid(set.id), sigs.getGridSize());
+	write_raw(out, sigs.hist(set.id), CuttleSignatureArena::hist_size);
+	write_raw(out, sigs.imageHash(set.id).data(), sigs.imageHash(set.id).size());
+	out << set.img_size << set.thumb;
+	return data;
+}
+
+// the perceptual hash and the cascade levels are derived on restore rather than stored
+bool CuttleCache::deserialize(QByteArray const & data, CuttleSet & set, CuttleSignatureArena & sigs) {
+	QDataStream in {data};
+	in.setVersion(QDataStream::Qt_6_0);
+	if (!read_raw(in, sigs.grid(set.id), sigs.getGridSize())) return false;
+	if (!read_raw(in, sigs.hist(set.id), CuttleSignatureArena::hist_size)) return false;
+	if (!read_raw(in, sigs.imageHash(set.id).data(), sigs.imageHash(set.id).size())) return false;
+	in >> set.img_size >> set.thumb;
+	return in.status() == QDataStream::Ok;
+}
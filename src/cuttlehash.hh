@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// streaming XXH64
+struct xxhash64 final {
+	
+	xxhash64(uint64_t seed = 0) : seed(seed) {
+		v[0] = seed + P1 + P2;
+		v[1] = seed + P2;
+		v[2] = seed;
+		v[3] = seed - P1;
+	}
+	
+	inline void update(void const * data, size_t len) {
+		uint8_t const * p = static_cast<uint8_t const *>(data);
+		total += len;
+		if (buffered + len < 32) {
+			memcpy(buffer + buffered, p, len);
+			buffered += len;
+			return;
+		}
+		if (buffered) {
+			size_t fill = 32 - buffered;
+			memcpy(buffer + buffered, p, fill);
+			consume(buffer);
+			p += fill;
+			len -= fill;
+			buffered = 0;
+		}
+		for (; len >= 32; p += 32, len -= 32) consume(p);
+		memcpy(buffer, p, len);
+		buffered = len;
+	}
+	
+	inline uint64_t digest() const {
+		uint64_t h;
+		if (total >= 32) {
+			h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+			for (uint64_t lane : v) h = (h ^ round(0, lane)) * P1 + P4;
+		} else {
+			h = seed + P5;
+		}
+		h += total;
+		
+		uint8_t const * p = buffer;
+		size_t len = buffered;
+		for (; len >= 8; p += 8, len -= 8) h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+		if (len >= 4) {
+			h = rotl(h ^ (read32(p) * P1), 23) * P2 + P3;
+			p += 4;
+			len -= 4;
+		}
+		for (; len; p++, len--) h = rotl(h ^ (*p * P5), 11) * P1;
+		
+		h ^= h >> 33;
+		h *= P2;
+		h ^= h >> 29;
+		h *= P3;
+		h ^= h >> 32;
+		return h;
+	}
+	
+	static inline uint64_t hash(void const * data, size_t len, uint64_t seed = 0) {
+		xxhash64 h {seed};
+		h.update(data, len);
+		return h.digest();
+	}
+	
+private:
+	static constexpr uint64_t P1 = 0x9E3779B185EBCA87ull;
+	static constexpr uint64_t P2 = 0xC2B2AE3D27D4EB4Full;
+	static constexpr uint64_t P3 = 0x165667B19E3779F9ull;
+	static constexpr uint64_t P4 = 0x85EBCA77C2B2AE63ull;
+	static constexpr uint64_t P5 = 0x27D4EB2F165667C5ull;
+	
+	static inline uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+	static inline uint64_t round(uint64_t acc, uint64_t input) { return rotl(acc + input * P2, 31) * P1; }
+	static inline uint64_t read64(uint8_t const * p) { uint64_t x; memcpy(&x, p, 8); return x; }
+	static inline uint64_t read32(uint8_t const * p) { uint32_t x; memcpy(&x, p, 4); return x; }
+	
+	inline void consume(uint8_t const * p) {
+		for (int i = 0; i < 4; i++) v[i] = round(v[i], read64(p + i * 8));
+	}
+	
+	uint64_t seed;
+	uint64_t v[4];
+	uint64_t total = 0;
+	uint8_t buffer[32];
+	size_t buffered = 0;
+};
@@ -0,0 +1,116 @@
+#include "cuttle.hh"
+
+#include "cuttlepool.hh"
+#include "cuttletrace.hh"
+
+CuttleImageCache::~CuttleImageCache() {
+	std::unique_lock<std::mutex> lock {lk};
+	idle.wait(lock, [this](){ return !running; });
+}
+
+QImage CuttleImageCache::get(CuttleSet const * set) {
+	{
+		std::lock_guard<std::mutex> guard {lk};
+		shown[1] = std::move(shown[0]);
+		shown[0] = set->filename;
+	}
+	return request(set->filename, false).get();
+}
+
+void CuttleImageCache::prefetch(CuttleSet const * set) {
+	request(set->filename, true);
+}
+
+std::shared_future<QImage> CuttleImageCache::request(QString const & filename, bool background) {
+	std::unique_lock<std::mutex> lock {lk};
+	auto iter = entries.find(filename);
+	if (iter != entries.end()) {
+		if (background) return iter->image; // a prefetch leaves the order alone, only images actually looked at become recent
+		lru.splice(lru.begin(), lru, iter->lru);
+		std::shared_future<QImage> image = iter->image;
+		// a prefetch still queued behind scan work on the pool is taken over here, only one already decoding is waited for
+		std::shared_ptr<Pending> pending = iter->pending;
+		lock.unlock();
+		if (pending && !pending->claimed.exchange(true)) pending->decode();
+		return image;
+	}
+	
+	auto promise = std::make_shared<std::promise<QImage>>();
+	uint64_t const ticket = next_ticket++;
+	std::shared_future<QImage> image = promise->get_future().share();
+	lru.push_front(filename);
+	
+	// a temporary set decodes exactly like the processor does, and keeps no pointer into sets a new run may clear
+	auto decode = [this, filename, ticket, promise](){
+		CuttleTraceSpan span {"decode full image"};
+		QImage img = CuttleSet {filename}.getImage();
+		promise->set_value(img);
+		admit(filename, ticket, img);
+	};
+	if (!background) {
+		entries.insert(filename, {image, 0, ticket, lru.begin(), nullptr});
+		lock.unlock();
+		decode();
+		return image;
+	}
+	auto pending = std::make_shared<Pending>();
+	pending->decode = std::move(decode);
+	entries.insert(filename, {image, 0, ticket, lru.begin(), pending});
+	running++;
+	lock.unlock();
+	CuttlePool::instance().push([this, pending](){
+		if (!pending->claimed.exchange(true)) pending->decode();
+		std::lock_guard<std::mutex> guard {lk};
+		if (!--running) idle.notify_all();
+	});
+	return image;
+}
+
+void CuttleImageCache::admit(QString const & filename, uint64_t ticket, QImage const & image) {
+	std::lock_guard<std::mutex> guard {lk};
+	auto iter = entries.find(filename);
+	if (iter == entries.end() || iter->ticket != ticket) return;
+	if (image.isNull()) {
+		drop(iter); // a failed decode is retried on the next request
+		return;
+	}
+	iter->bytes = image.sizeInBytes();
+	used += iter->bytes;
+	evict();
+}
+
+void CuttleImageCache::evict() {
+	for (auto pos = lru.end(); used > budget && pos != lru.begin();) {
+		--pos;
+		auto iter = entries.find(*pos);
+		if (!iter->bytes || *pos == shown[0] || *pos == shown[1]) continue;
+		pos = lru.erase(pos);
+		used -= iter->bytes;
+		entries.erase(iter);
+	}
+}
+
+void CuttleImageCache::drop(QHash<QString, Entry>::iterator iter) {
+	used -= iter->bytes;
+	lru.erase(iter->lru);
+	entries.erase(iter);
+}
+
+void CuttleImageCache::forget(QString const & filename) {
+	std::lock_guard<std::mutex> guard {lk};
+	auto iter = entries.find(filename);
+	if (iter != entries.end()) drop(iter);
+}
+
+void CuttleImageCache::clear() {
+	std::lock_guard<std::mutex> guard {lk};
+	entries.clear();
+	lru.clear();
+	used = 0;
+}
+
+void CuttleImageCache::setBudget(size_t bytes) {
+	std::lock_guard<std::mutex> guard {lk};
+	budget = bytes;
+	evict();
+}
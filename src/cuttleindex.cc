@@ -0,0 +1,112 @@
+#include "cuttle.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+void CuttleHashIndex::build(std::vector<uint64_t> && hashes, unsigned radius) {
+	this->hashes = std::move(hashes);
+	this->radius = radius;
+	
+	masks.clear();
+	unsigned const chunk_radius = radius / 4;
+	for (uint32_t m = 0; m < 65536; m++) {
+		if (static_cast<unsigned>(__builtin_popcount(m)) <= chunk_radius) masks.push_back(m);
+	}
+	
+	for (unsigned c = 0; c < 4; c++) {
+		offsets[c].assign(65537, 0);
+		for (uint64_t h : this->hashes) offsets[c][chunk(h, c) + 1]++;
+		for (uint32_t k = 0; k < 65536; k++) offsets[c][k + 1] += offsets[c][k];
+		ids[c].resize(this->hashes.size());
+		std::vector<uint32_t> fill {offsets[c].begin(), offsets[c].end() - 1};
+		for (uint32_t i = 0; i < this->hashes.size(); i++) ids[c][fill[chunk(this->hashes[i], c)]++] = i;
+	}
+}
+
+//================================
+
+float CuttleVPTree::distance(size_t a, size_t b) const {
+	float const * pa = points.data() + a * dims;
+	float const * pb = points.data() + b * dims;
+	float sum = 0;
+	for (size_t i = 0; i < dims; i++) {
+		float d = pa[i] - pb[i];
+		sum += d * d;
+	}
+	return std::sqrt(sum);
+}
+
+void CuttleVPTree::build(std::vector<float> && points, size_t dims) {
+	this->points = std::move(points);
+	this->dims = dims;
+	nodes.clear();
+	size_t const count = size();
+	nodes.reserve(count);
+	std::vector<uint32_t> order (count);
+	for (uint32_t i = 0; i < count; i++) order[i] = i;
+	std::vector<float> scratch (count);
+	if (count) build(order.data(), order.data() + count, scratch);
+}
+
+// the middle element becomes the vantage point, the rest is split at the median distance to it
+int32_t CuttleVPTree::build(uint32_t * begin, uint32_t * end, std::vector<float> & scratch) {
+	if (begin == end) return -1;
+	std::swap(*begin, begin[(end - begin) / 2]);
+	int32_t index = nodes.size();
+	nodes.push_back({*begin, 0, -1, -1});
+	
+	uint32_t * first = begin + 1;
+	if (first == end) return index;
+	for (uint32_t * p = first; p != end; p++) scratch[*p] = distance(*begin, *p);
+	uint32_t * mid = first + (end - first) / 2;
+	std::nth_element(first, mid, end, [&scratch](uint32_t a, uint32_t b){ return scratch[a] < scratch[b]; });
+	nodes[index].mu = scratch[*mid];
+	
+	int32_t inside = build(first, mid, scratch);
+	int32_t outside = build(mid, end, scratch);
+	nodes[index].inside = inside;
+	nodes[index].outside = outside;
+	return index;
+}
+
+void CuttleVPTree::query(size_t i, size_t k, std::function<bool(uint32_t)> const & accept, std::vector<uint32_t> & out) const {
+	out.clear();
+	if (nodes.empty() || !k) return;
+	
+	typedef std::pair<float, uint32_t> hit_t;
+	std::vector<hit_t> heap {}; // max heap on distance
+	heap.reserve(k + 1);
+	float tau = std::numeric_limits<float>::infinity();
+	
+	std::vector<int32_t> stack {0};
+	while (!stack.empty()) {
+		int32_t n = stack.back();
+		stack.pop_back();
+		if (n < 0) continue;
+		Node const & node = nodes[n];
+		float d = distance(i, node.point);
+		
+		if (node.point != i && d < tau && accept(node.point)) {
+			heap.emplace_back(d, node.point);
+			std::push_heap(heap.begin(), heap.end());
+			if (heap.size() > k) {
+				std::pop_heap(heap.begin(), heap.end());
+				heap.pop_back();
+			}
+			if (heap.size() == k) tau = heap.front().first;
+		}
+		
+		// pushed in reverse so the side the query falls in is searched first
+		if (d < node.mu) {
+			if (d + tau >= node.mu) stack.push_back(node.outside);
+			if (d - tau <= node.mu) stack.push_back(node.inside);
+		} else {
+			if (d - tau <= node.mu) stack.push_back(node.inside);
+			if (d + tau >= node.mu) stack.push_back(node.outside);
+		}
+	}
+	
+	std::sort_heap(heap.begin(), heap.end());
+	for (hit_t const & hit : heap) out.push_back(hit.second);
+}
@@ -3,99 +3,93 @@
 #include "QElidedLabel.hh"
 #include <QtWidgets>
 
-CuttleLeftItem::CuttleLeftItem(QWidget * parent, CuttleSet const * set, CuttleProcessor * proc) : QFrame(parent), set(set), proc(proc) {
-	setFrameStyle(QFrame::StyledPanel | QFrame::Raised);
-	setSizePolicy(QSizePolicy::MinimumExpanding, QSizePolicy::Maximum);
-	QGridLayout * layout = new QGridLayout {this};
-	
-	QFileInfo finfo { set->filename };
-	QLabel * nameLabel = new QLabel { finfo.fileName(), this };
-	nameLabel->setToolTip(finfo.canonicalFilePath());
-	nameLabel->setMinimumWidth(LEFT_COLUMN_SIZE - 50);
-	nameLabel->setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Maximum);
-	QFontMetrics metrics { nameLabel->font() };
-	layout->addWidget(nameLabel, 0, 0, 1, 1);
-	nameLabel->setText( metrics.elidedText(nameLabel->text(), Qt::ElideMiddle, nameLabel->width()) );
-	
-	QWidget * lowerWidget = new QWidget {this};
-	QHBoxLayout * lowerLayout = new QHBoxLayout {lowerWidget};
-	
-	high = 0;
-	for (CuttleSet const & cset : proc->getSets()) {
-		if (cset.id == set->id) continue;
-		double v = proc->getMatchData(set, &cset).value;
-		if (v > high) high = v;
+CuttleSetModel::CuttleSetModel(QObject * parent, QString const & value_format) : QAbstractListModel(parent), value_format(value_format) {}
+
+int CuttleSetModel::rowCount(QModelIndex const & parent) const {
+	return parent.isValid() ? 0 : static_cast<int>(rows.size());
+}
+
+QVariant CuttleSetModel::data(QModelIndex const & index, int role) const {
+	CuttleSet const * set = setAt(index.row());
+	if (!index.isValid() || !set) return {};
+	switch (role) {
+		case Qt::DisplayRole:
+			return QFileInfo {set->filename}.fileName();
+		case Qt::ToolTipRole:
+			return QFileInfo {set->filename}.canonicalFilePath();
+		case Qt::DecorationRole:
+			return set->thumb;
+		case SetRole:
+			return QVariant::fromValue(const_cast<void *>(static_cast<void const *>(set)));
+		case ValueRole:
+			return values[index.row()];
+		case ValueTextRole:
+			return value_format.arg(values[index.row()]);
+		default:
+			return {};
 	}
-	
-	QLabel * thumb = new QLabel {this};
-	thumb->setFixedSize(THUMB_SIZE, THUMB_SIZE);
-	thumb->setSizePolicy(QSizePolicy::Fixed, QSizePolicy::Fixed);
-	thumb->setPixmap(set->thumb);
-	lowerLayout->addWidget(thumb);
-	
-	QPushButton * activateButton = new QPushButton {"GO"};
-	token = activateButton;
-	activateButton->setMinimumWidth(15);
-	activateButton->setSizePolicy(QSizePolicy::Maximum, QSizePolicy::MinimumExpanding);
-	connect(activateButton, &QPushButton::clicked, this, [=](){emit activated(set);});
-	lowerLayout->addWidget(activateButton);
-	
-	QLabel * highestMatchLabel = new QLabel {QString("High: %1").arg(high), lowerWidget};
-	lowerLayout->addWidget(highestMatchLabel);
-	
-	lowerLayout->setContentsMargins(0, 0, 0, 0);
-	layout->addWidget(lowerWidget, 1, 0, 1, 1);
-	
-	connect(this, &CuttleLeftItem::recalculateHigh, this, [=](){
-		high = 0;
-		for (CuttleSet const & cset : proc->getSets()) {
-			if (cset.id == set->id) continue;
-			double v = proc->getMatchData(set, &cset).value;
-			if (v > high) high = v;
-		}
-	});
 }
 
-void CuttleLeftItem::activate() {
-	reinterpret_cast<QPushButton *>(token)->click();
+void CuttleSetModel::assign(std::vector<CuttleSet const *> && sets, std::function<double(CuttleSet const *)> const & value) {
+	beginResetModel();
+	rows = std::move(sets);
+	values.resize(rows.size());
+	std::transform(rows.begin(), rows.end(), values.begin(), value);
+	endResetModel();
 }
 
-CuttleRightItem::CuttleRightItem(QWidget * parent, CuttleSet const * set, CuttleSet const * other, CuttleProcessor * proc) : QFrame(parent), set(set) {
-	setFrameStyle(QFrame::StyledPanel | QFrame::Raised);
-	setSizePolicy(QSizePolicy::MinimumExpanding, QSizePolicy::Maximum);
-	QGridLayout * layout = new QGridLayout {this};
-	
-	QFileInfo finfo { set->filename };
-	QLabel * nameLabel = new QLabel { finfo.fileName(), this };
-	nameLabel->setToolTip(finfo.canonicalFilePath());
-	nameLabel->setMinimumWidth(RIGHT_COLUMN_SIZE - 50);
-	nameLabel->setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Maximum);
-	QFontMetrics metrics { nameLabel->font() };
-	layout->addWidget(nameLabel, 0, 0, 1, 1);
-	nameLabel->setText( metrics.elidedText(nameLabel->text(), Qt::ElideMiddle, nameLabel->width()) );
-	
-	QWidget * lowerWidget = new QWidget {this};
-	QHBoxLayout * lowerLayout = new QHBoxLayout {lowerWidget};
-	
-	value = proc->getMatchData(set, other).value;
-	
-	QLabel * thumb = new QLabel {this};
-	thumb->setFixedSize(THUMB_SIZE, THUMB_SIZE);
-	thumb->setSizePolicy(QSizePolicy::Fixed, QSizePolicy::Fixed);
-	thumb->setPixmap(set->thumb);
-	lowerLayout->addWidget(thumb);
-	
-	QPushButton * activateButton = new QPushButton {"GO"};
-	activateButton->setMinimumWidth(15);
-	activateButton->setSizePolicy(QSizePolicy::Maximum, QSizePolicy::MinimumExpanding);
-	connect(activateButton, &QPushButton::clicked, this, [=](){emit activated(set);});
-	lowerLayout->addWidget(activateButton);
-	
-	QLabel * highestMatchLabel = new QLabel {QString("Value: %1").arg(value), lowerWidget};
-	lowerLayout->addWidget(highestMatchLabel);
+void CuttleSetModel::clear() {
+	beginResetModel();
+	rows.clear();
+	values.clear();
+	endResetModel();
+}
+
+int CuttleSetModel::rowOf(CuttleSet const * set) const {
+	auto iter = std::find(rows.begin(), rows.end(), set);
+	return iter == rows.end() ? -1 : iter - rows.begin();
+}
+
+static constexpr int row_margin = 6;
+static constexpr int row_spacing = 4;
+
+void CuttleSetDelegate::paint(QPainter * painter, QStyleOptionViewItem const & option, QModelIndex const & index) const {
+	QStyleOptionViewItem opt = option;
+	initStyleOption(&opt, index);
+	QStyle * style = opt.widget ? opt.widget->style() : QApplication::style();
+	
+	style->drawPrimitive(QStyle::PE_PanelItemViewItem, &opt, painter, opt.widget);
+	QStyleOptionFrame frame {};
+	frame.QStyleOption::operator = (opt);
+	frame.rect = opt.rect.adjusted(1, 1, -1, -1);
+	frame.state |= QStyle::State_Raised;
+	frame.lineWidth = 1;
+	style->drawPrimitive(QStyle::PE_Frame, &frame, painter, opt.widget);
+	
+	painter->save();
+	painter->setFont(opt.font);
+	painter->setPen(opt.palette.color(opt.state & QStyle::State_Enabled ? QPalette::Normal : QPalette::Disabled, opt.state & QStyle::State_Selected ? QPalette::HighlightedText : QPalette::Text));
+	
+	QRect const inner = opt.rect.adjusted(row_margin, row_margin, -row_margin, -row_margin);
+	QFontMetrics const & metrics = opt.fontMetrics;
+	QRect const nameRect {inner.left(), inner.top(), inner.width(), metrics.height()};
+	painter->drawText(nameRect, Qt::AlignLeft | Qt::AlignVCenter, metrics.elidedText(opt.text, Qt::ElideMiddle, nameRect.width()));
+	
+	QRect const thumbRect {inner.left(), nameRect.bottom() + 1 + row_spacing, THUMB_SIZE, THUMB_SIZE};
+	QImage const thumb = index.data(Qt::DecorationRole).value<QImage>();
+	if (!thumb.isNull()) {
+		QSize size = thumb.size().scaled(thumbRect.size(), Qt::KeepAspectRatio);
+		painter->drawImage(QRect {thumbRect.topLeft() + QPoint {(THUMB_SIZE - size.width()) / 2, (THUMB_SIZE - size.height()) / 2}, size}, thumb);
+	}
 	
-	lowerLayout->setContentsMargins(0, 0, 0, 0);
-	layout->addWidget(lowerWidget, 1, 0, 1, 1);
+	QRect const valueRect {thumbRect.right() + 1 + row_spacing * 2, thumbRect.top(), inner.right() - thumbRect.right() - row_spacing * 2, THUMB_SIZE};
+	painter->drawText(valueRect, Qt::AlignLeft | Qt::AlignVCenter, index.data(CuttleSetModel::ValueTextRole).toString());
+	painter->restore();
+}
+
+// every row has the same height, which lets the view place rows without measuring them (uniformItemSizes)
+QSize CuttleSetDelegate::sizeHint(QStyleOptionViewItem const & option, QModelIndex const &) const {
+	return {THUMB_SIZE + row_margin * 2, option.fontMetrics.height() + row_spacing + THUMB_SIZE + row_margin * 2};
 }
 
 static QString readable_file_size(qint64 b) {
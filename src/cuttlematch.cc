@@ -0,0 +1,262 @@
+#include "cuttle.hh"
+
+#include <algorithm>
+#include <limits>
+
+void CuttleMatchStore::reset(uint_fast32_t size, double floor, uint_fast32_t top_k) {
+	std::lock_guard<std::mutex> guard {lk};
+	this->size = size;
+	this->floor = floor;
+	floor_score = CuttleMatchData::quantize(floor);
+	this->top_k = top_k;
+	pending.clear();
+	offsets.assign(size + 1, 0);
+	neighbours.clear();
+}
+
+void CuttleMatchStore::clear() {
+	reset(0, floor, top_k);
+}
+
+void CuttleMatchStore::insert(std::vector<Edge> & edges) {
+	if (edges.empty()) return;
+	std::lock_guard<std::mutex> guard {lk};
+	pending.insert(pending.end(), edges.begin(), edges.end());
+	edges.clear();
+	if (top_k && pending.size() > 2 * static_cast<size_t>(top_k) * size) prune();
+}
+
+// keeps every edge that is among the top K of at least one of its two sets
+void CuttleMatchStore::prune() {
+	std::sort(pending.begin(), pending.end(), [](Edge const & a, Edge const & b){ return a.data.bits > b.data.bits; });
+	std::vector<uint_fast32_t> seen (size, 0);
+	auto kept = pending.begin();
+	for (Edge const & edge : pending) {
+		bool keep = seen[edge.A] < top_k || seen[edge.B] < top_k;
+		seen[edge.A]++;
+		seen[edge.B]++;
+		if (keep) *kept++ = edge;
+	}
+	pending.erase(kept, pending.end());
+}
+
+void CuttleMatchStore::finalize() {
+	std::lock_guard<std::mutex> guard {lk};
+	if (top_k) prune();
+	
+	offsets.assign(size + 1, 0);
+	for (Edge const & edge : pending) {
+		offsets[edge.A + 1]++;
+		offsets[edge.B + 1]++;
+	}
+	for (uint_fast32_t i = 0; i < size; i++) offsets[i + 1] += offsets[i];
+	
+	neighbours.resize(offsets[size]);
+	std::vector<uint_fast32_t> fill {offsets.begin(), offsets.end() - 1};
+	for (Edge const & edge : pending) {
+		neighbours[fill[edge.A]++] = {edge.B, edge.data};
+		neighbours[fill[edge.B]++] = {edge.A, edge.data};
+	}
+	for (uint_fast32_t i = 0; i < size; i++) {
+		std::sort(neighbours.begin() + offsets[i], neighbours.begin() + offsets[i + 1], [](Neighbour const & a, Neighbour const & b){ return a.id < b.id; });
+	}
+	
+	pending.clear();
+	pending.shrink_to_fit();
+}
+
+void CuttleMatchStore::grow(uint_fast32_t size) {
+	std::lock_guard<std::mutex> guard {lk};
+	if (size <= this->size) return;
+	offsets.resize(size + 1, offsets.empty() ? 0 : offsets.back());
+	this->size = size;
+}
+
+// Only the new edges are pruned, nothing already stored is collected or sorted again. Rows are rewritten back to front,
+// each moving towards the end into space its successors have already vacated, and rows before the first one that gains
+// an edge are not touched at all.
+void CuttleMatchStore::merge(std::vector<Edge> & edges) {
+	std::lock_guard<std::mutex> guard {lk};
+	pending.insert(pending.end(), edges.begin(), edges.end());
+	edges.clear();
+	if (pending.empty()) return;
+	if (top_k) prune();
+	
+	std::vector<std::pair<uint32_t, Neighbour>> added {};
+	added.reserve(pending.size() * 2);
+	for (Edge const & edge : pending) {
+		added.push_back({edge.A, {edge.B, edge.data}});
+		added.push_back({edge.B, {edge.A, edge.data}});
+	}
+	pending.clear();
+	std::sort(added.begin(), added.end(), [](auto const & a, auto const & b){ return a.first != b.first ? a.first < b.first : a.second.id < b.second.id; });
+	
+	neighbours.resize(neighbours.size() + added.size());
+	auto row_end = added.end();
+	for (uint_fast32_t a = size; a-- > 0 && row_end != added.begin();) {
+		auto row_begin = row_end;
+		while (row_begin != added.begin() && (row_begin - 1)->first == a) row_begin--;
+		size_t const shift = row_begin - added.begin(); // entries added to the rows before this one
+		uint_fast32_t const begin = offsets[a], end = offsets[a + 1];
+		size_t const new_end = end + shift + (row_end - row_begin);
+		
+		size_t out = new_end, in = end;
+		for (auto r = row_end; r != row_begin;) {
+			if (in > begin && neighbours[in - 1].id > (r - 1)->second.id) neighbours[--out] = neighbours[--in];
+			else neighbours[--out] = (--r)->second;
+		}
+		if (shift) std::move_backward(neighbours.begin() + begin, neighbours.begin() + in, neighbours.begin() + out);
+		offsets[a + 1] = new_end;
+		row_end = row_begin;
+	}
+}
+
+CuttleMatchStore::Neighbour const * CuttleMatchStore::find(uint_fast32_t A, uint_fast32_t B) const {
+	if (A >= size || B >= size) return nullptr;
+	auto begin = neighbours.begin() + offsets[A], end = neighbours.begin() + offsets[A + 1];
+	auto iter = std::lower_bound(begin, end, B, [](Neighbour const & n, uint_fast32_t id){ return n.id < id; });
+	if (iter == end || iter->id != B) return nullptr;
+	return &*iter;
+}
+
+CuttleMatchData const & CuttleMatchStore::get(uint_fast32_t A, uint_fast32_t B) const {
+	Neighbour const * n = find(A, B);
+	return n ? n->data : invalid_match;
+}
+
+void CuttleMatchStore::invalidate(uint_fast32_t A, uint_fast32_t B) {
+	if (Neighbour const * n = find(A, B)) const_cast<Neighbour *>(n)->data = invalid_match;
+	if (Neighbour const * n = find(B, A)) const_cast<Neighbour *>(n)->data = invalid_match;
+}
+
+//--------------------------------
+
+static inline bool ranks_before(CuttleRanking::Entry const & a, CuttleRanking::Entry const & b) {
+	return a.score != b.score ? a.score > b.score : a.id < b.id;
+}
+
+static inline bool edge_ranks_before(CuttleMatchStore::Edge const & a, CuttleMatchStore::Edge const & b) {
+	if (a.data.score() != b.data.score()) return a.data.score() > b.data.score();
+	return a.A != b.A ? a.A < b.A : a.B < b.B;
+}
+
+bool CuttleRanking::live_pair(std::vector<CuttleSet const *> const & live, uint_fast32_t A, uint_fast32_t B) {
+	CuttleSet const * a = A < live.size() ? live[A] : nullptr;
+	CuttleSet const * b = B < live.size() ? live[B] : nullptr;
+	if (!a || !b) return false;
+	return !(a->group && b->group && a->group == b->group);
+}
+
+uint16_t CuttleRanking::best_of(CuttleMatchStore const & store, std::vector<CuttleSet const *> const & live, uint_fast32_t id) const {
+	if (id >= store.getSize()) return 0;
+	uint16_t high = 0;
+	for (auto n = store.neighboursBegin(id); n != store.neighboursEnd(id); n++) {
+		if (live_pair(live, id, n->id)) high = std::max(high, n->data.score());
+	}
+	return high;
+}
+
+void CuttleRanking::build(CuttleMatchStore const & store, std::vector<CuttleSet const *> const & live) {
+	clear();
+	best.assign(live.size(), 0);
+	for (uint_fast32_t id = 0; id < live.size(); id++) {
+		if (!live[id]) continue;
+		best[id] = best_of(store, live, id);
+		sets.push_back({best[id], static_cast<uint32_t>(id)});
+		if (id >= store.getSize()) continue;
+		for (auto n = store.neighboursBegin(id); n != store.neighboursEnd(id); n++) {
+			if (n->id > id && n->data.bits != invalid_match.bits && live_pair(live, id, n->id)) edges.push_back({static_cast<uint32_t>(id), n->id, n->data});
+		}
+	}
+	std::sort(sets.begin(), sets.end(), ranks_before);
+	std::sort(edges.begin(), edges.end(), edge_ranks_before);
+}
+
+void CuttleRanking::update(CuttleMatchStore const & store, std::vector<CuttleSet const *> const & live, std::vector<uint32_t> const & touched) {
+	if (best.size() < live.size()) best.resize(live.size(), 0);
+	std::vector<uint8_t> marked (best.size(), false);
+	std::vector<uint32_t> ids {};
+	std::vector<Entry> fresh {};
+	for (uint32_t id : touched) {
+		if (id >= best.size() || marked[id]) continue;
+		marked[id] = true;
+		ids.push_back(id);
+		bool const alive = id < live.size() && live[id];
+		best[id] = alive ? best_of(store, live, id) : 0;
+		if (alive) fresh.push_back({best[id], id});
+	}
+	
+	// the untouched entries stay in order, the touched ones are sorted on their own and merged back in
+	auto kept = std::remove_if(sets.begin(), sets.end(), [&](Entry const & e){ return marked[e.id]; });
+	sets.erase(kept, sets.end());
+	std::sort(fresh.begin(), fresh.end(), ranks_before);
+	size_t mid = sets.size();
+	sets.insert(sets.end(), fresh.begin(), fresh.end());
+	std::inplace_merge(sets.begin(), sets.begin() + mid, sets.end(), ranks_before);
+	
+	// the pairs of touched sets are read back from the store, which drops removed and invalidated ones and picks up new ones
+	edges.erase(std::remove_if(edges.begin(), edges.end(), [&](CuttleMatchStore::Edge const & e){ return marked[e.A] || marked[e.B]; }), edges.end());
+	std::vector<CuttleMatchStore::Edge> found {};
+	for (uint32_t id : ids) {
+		if (id >= store.getSize()) continue;
+		for (auto n = store.neighboursBegin(id); n != store.neighboursEnd(id); n++) {
+			if (n->id < id && n->id < marked.size() && marked[n->id]) continue; // read from the other side
+			if (n->data.bits == invalid_match.bits || !live_pair(live, id, n->id)) continue;
+			found.push_back({std::min<uint32_t>(id, n->id), std::max<uint32_t>(id, n->id), n->data});
+		}
+	}
+	std::sort(found.begin(), found.end(), edge_ranks_before);
+	mid = edges.size();
+	edges.insert(edges.end(), found.begin(), found.end());
+	std::inplace_merge(edges.begin(), edges.begin() + mid, edges.end(), edge_ranks_before);
+}
+
+void CuttleRanking::clear() {
+	best.clear();
+	sets.clear();
+	edges.clear();
+}
+
+size_t CuttleRanking::setsAbove(uint16_t score) const {
+	return std::partition_point(sets.begin(), sets.end(), [=](Entry const & e){ return e.score >= score; }) - sets.begin();
+}
+
+size_t CuttleRanking::edgesAbove(uint16_t score) const {
+	return std::partition_point(edges.begin(), edges.end(), [=](CuttleMatchStore::Edge const & e){ return e.data.score() >= score; }) - edges.begin();
+}
+
+std::vector<std::vector<uint32_t>> CuttleRanking::clusters(uint16_t score) const {
+	// union by size with path halving, linear in the number of edges for every practical purpose
+	std::vector<uint32_t> parent (best.size()), size (best.size(), 1);
+	for (uint32_t i = 0; i < parent.size(); i++) parent[i] = i;
+	auto find = [&](uint32_t i){
+		while (parent[i] != i) i = parent[i] = parent[parent[i]];
+		return i;
+	};
+	
+	size_t const count = edgesAbove(score);
+	for (size_t i = 0; i < count; i++) {
+		uint32_t a = find(edges[i].A), b = find(edges[i].B);
+		if (a == b) continue;
+		if (size[a] < size[b]) std::swap(a, b);
+		parent[b] = a;
+		size[a] += size[b];
+	}
+	
+	// the edges are sorted, so the first edge seen of every component is its strongest
+	static constexpr uint32_t no_cluster = std::numeric_limits<uint32_t>::max();
+	std::vector<uint32_t> index (best.size(), no_cluster);
+	std::vector<std::vector<uint32_t>> out {};
+	for (size_t i = 0; i < count; i++) {
+		uint32_t root = find(edges[i].A);
+		if (index[root] != no_cluster) continue;
+		index[root] = out.size();
+		out.emplace_back();
+		out.back().reserve(size[root]);
+	}
+	for (size_t i = 0, sets_count = setsAbove(score); i < sets_count; i++) {
+		uint32_t root = find(sets[i].id);
+		if (index[root] != no_cluster) out[index[root]].push_back(sets[i].id);
+	}
+	return out;
+}
@@ -0,0 +1,136 @@
+#include "cuttlepool.hh"
+
+static thread_local int local_index = -1;
+static thread_local CuttlePool const * local_pool = nullptr;
+
+CuttlePool & CuttlePool::instance() {
+	static CuttlePool pool {};
+	return pool;
+}
+
+CuttlePool & CuttlePool::io() {
+	static CuttlePool pool {io_threads};
+	return pool;
+}
+
+CuttlePool::CuttlePool(unsigned count) {
+	start(count);
+}
+
+CuttlePool::~CuttlePool() {
+	stop();
+}
+
+void CuttlePool::setThreadCount(unsigned count) {
+	if (!count) count = std::max(1u, std::thread::hardware_concurrency());
+	if (count == workers.size()) return;
+	stop();
+	start(count);
+}
+
+void CuttlePool::start(unsigned count) {
+	if (!count) count = std::max(1u, std::thread::hardware_concurrency());
+	running.store(true);
+	queues.clear();
+	for (unsigned i = 0; i < count; i++) queues.emplace_back(new Queue {});
+	for (unsigned i = 0; i < count; i++) workers.emplace_back([this, i](){ worker_loop(i); });
+}
+
+void CuttlePool::stop() {
+	{
+		std::lock_guard<std::mutex> lock {sleep_lk};
+		running.store(false);
+	}
+	sleep_cv.notify_all();
+	for (std::thread & w : workers) if (w.joinable()) w.join();
+	workers.clear();
+}
+
+void CuttlePool::push(task && t) {
+	unsigned q = (local_pool == this && local_index >= 0) ? local_index : next_queue.fetch_add(1) % queues.size();
+	{
+		std::lock_guard<std::mutex> lock {queues[q]->lk};
+		queues[q]->tasks.push_back(std::move(t));
+	}
+	queued.fetch_add(1);
+	{
+		std::lock_guard<std::mutex> lock {sleep_lk};
+	}
+	sleep_cv.notify_one();
+}
+
+// pops from the back of our own queue, steals from the front of everyone else's
+bool CuttlePool::run_one(int self) {
+	size_t count = queues.size();
+	size_t first = self >= 0 ? self : 0;
+	for (size_t i = 0; i < count; i++) {
+		Queue & q = *queues[(first + i) % count];
+		task t;
+		{
+			std::lock_guard<std::mutex> lock {q.lk};
+			if (q.tasks.empty()) continue;
+			if (self >= 0 && i == 0) {
+				t = std::move(q.tasks.back());
+				q.tasks.pop_back();
+			} else {
+				t = std::move(q.tasks.front());
+				q.tasks.pop_front();
+			}
+		}
+		queued.fetch_sub(1);
+		t();
+		return true;
+	}
+	return false;
+}
+
+void CuttlePool::worker_loop(unsigned index) {
+	local_index = index;
+	local_pool = this;
+	while (true) {
+		if (run_one(index)) continue;
+		std::unique_lock<std::mutex> lock {sleep_lk};
+		sleep_cv.wait(lock, [this](){ return !running.load() || queued.load() > 0; });
+		if (!running.load() && !queued.load()) return;
+	}
+}
+
+void CuttlePool::parallel_for(size_t count, std::function<void(size_t)> const & func, std::atomic_bool const * run) {
+	if (!count) return;
+	
+	size_t const helpers = std::min<size_t>(workers.size(), count - 1);
+	struct state_t {
+		std::atomic_size_t next {0};
+		std::unique_ptr<std::atomic_bool[]> claimed; // a helper runs only if it claims its slot before the caller does
+		size_t running; // helpers not yet finished or cancelled
+		std::mutex lk;
+		std::condition_variable done;
+	};
+	auto state = std::make_shared<state_t>();
+	state->claimed.reset(new std::atomic_bool[helpers] {});
+	state->running = helpers;
+	
+	auto body = [state, count, &func, run](){
+		size_t i;
+		while ((!run || run->load()) && (i = state->next.fetch_add(1)) < count) func(i);
+	};
+	auto finish = [state](){
+		std::lock_guard<std::mutex> guard {state->lk};
+		if (!--state->running) state->done.notify_all();
+	};
+	
+	for (size_t h = 0; h < helpers; h++) push([state, body, finish, h](){
+		// the caller got here first, the range is exhausted and func may no longer exist
+		if (state->claimed[h].exchange(true)) return;
+		body();
+		finish();
+	});
+	
+	body();
+	
+	// the range is exhausted: helpers that have not started are cancelled, the ones running are waited for. The caller
+	// never runs unrelated queued work, which on the GUI thread could be a long decode or a whole scan stage.
+	for (size_t h = 0; h < helpers; h++) if (!state->claimed[h].exchange(true)) finish();
+	std::unique_lock<std::mutex> lock {state->lk};
+	state->done.wait(lock, [&](){ return !state->running; });
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// process-wide work stealing thread pool, every worker owns a deque and steals from the others when it runs dry
+class CuttlePool final {
+public:
+	typedef std::function<void()> task;
+	
+	static CuttlePool & instance();
+	// a second pool of io_threads for stages that block on disks and queues, so they never hold workers meant for compute
+	static CuttlePool & io();
+	static constexpr unsigned io_threads = 8;
+	
+	// 0 selects std::thread::hardware_concurrency, only call while the pool is idle
+	void setThreadCount(unsigned count);
+	inline unsigned getThreadCount() const { return workers.size(); }
+	
+	void push(task && t);
+	
+	template <typename F> auto submit(F && func) -> std::future<decltype(func())> {
+		auto pt = std::make_shared<std::packaged_task<decltype(func())()>>(std::forward<F>(func));
+		auto future = pt->get_future();
+		push([pt](){ (*pt)(); });
+		return future;
+	}
+	
+	// runs func(0 .. count - 1) on the pool and the calling thread, returns once every index has completed or run has been cleared
+	void parallel_for(size_t count, std::function<void(size_t)> const & func, std::atomic_bool const * run = nullptr);
+	
+	~CuttlePool();
+private:
+	CuttlePool(unsigned count = 0);
+	CuttlePool(CuttlePool const &) = delete;
+	
+	struct Queue {
+		std::mutex lk;
+		std::deque<task> tasks;
+	};
+	
+	void start(unsigned count);
+	void stop();
+	bool run_one(int self);
+	void worker_loop(unsigned index);
+	
+	std::vector<std::unique_ptr<Queue>> queues {};
+	std::vector<std::thread> workers {};
+	std::atomic_bool running {false};
+	std::atomic_size_t queued {0};
+	std::atomic_uint next_queue {0};
+	std::mutex sleep_lk;
+	std::condition_variable sleep_cv;
+};
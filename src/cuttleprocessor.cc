@@ -1,30 +1,152 @@
 #include "cuttle.hh"
 
+#include "cuttlebudget.hh"
+#include "cuttlehash.hh"
+#include "cuttlepool.hh"
+#include "cuttlequeue.hh"
+#include "cuttlesimd.hh"
+#include "cuttletrace.hh"
 #include "rw_spinlock.hh"
 
+#include <QBuffer>
 #include <QDirIterator>
+#include <QFile>
 #include <QSet>
 #include <QImageReader>
 #include <QCryptographicHash>
 
 #include <chrono>
+#include <cstring>
+#include <limits>
 #include <mutex>
 #include <ctgmath>
 
-CuttleProcessor::CuttleProcessor(QObject * parent) : QObject(parent) {}
+static constexpr uint_fast32_t delta_tile_size = 64;
+static constexpr size_t walker_count = 4; // directory listing is latency bound, a few walkers hide it
+static constexpr size_t reader_count = 4;
+static_assert(walker_count + reader_count <= CuttlePool::io_threads, "every I/O stage needs its own thread, they block on each other");
+static constexpr size_t file_queue_size = 1024;
+static constexpr std::chrono::seconds cache_save_interval {60}; // a busy watched directory would otherwise rewrite the cache on every rescan
+static constexpr std::chrono::milliseconds settle_delay {2000};
 
-CuttleProcessor::~CuttleProcessor() {
-	if (worker) {
-		worker_run.store(false);
-		if (worker->joinable()) worker->join();
-		delete worker;
-	}
-	if (match_data_size) {
-		for (size_t i = 1; i < match_data_size; i++) {
-			delete [] match_data_fast[i];
-		}
-		delete [] match_data_fast;
+// maps a linear tile index onto the lower triangle of the block matrix, row A >= column B
+static inline void tile_coords(uint_fast64_t tile, uint_fast32_t & A, uint_fast32_t & B) {
+	uint_fast64_t row = (std::sqrt(8.0 * tile + 1.0) - 1.0) / 2.0;
+	while (row * (row + 1) / 2 > tile) row--;
+	while ((row + 1) * (row + 2) / 2 <= tile) row++;
+	A = row;
+	B = tile - row * (row + 1) / 2;
+}
+
+static inline void setup_reader(QImageReader & read) {
+	read.setAllocationLimit(4096);
+	read.setAutoDetectImageFormat(true);
+	read.setDecideFormatFromContent(true);
+}
+
+// estimated peak of decoded pixels at four bytes each: the scaled image and its format conversion, plus the full image when the plugin cannot scale while decoding
+static inline size_t decode_footprint(QSize full, QSize scaled, bool plugin_scales) {
+	size_t pixels = static_cast<size_t>(scaled.width()) * scaled.height() * 2;
+	if (!plugin_scales) pixels += static_cast<size_t>(full.width()) * full.height();
+	return pixels * 4;
+}
+
+// without a size in the header only the encoded size is known, compressed images rarely expand beyond this
+static constexpr size_t unknown_expansion = 16;
+
+// the smallest size that still covers res x res and the thumbnail, full when the image is no larger than that
+static inline QSize reduced_size(QSize full, uint_fast16_t res) {
+	double scale = std::max({
+		static_cast<double>(res) / full.width(),
+		static_cast<double>(res) / full.height(),
+		static_cast<double>(THUMB_SIZE) / std::max(full.width(), full.height())
+	});
+	if (scale >= 1.0) return full;
+	return {static_cast<int>(std::ceil(full.width() * scale)), static_cast<int>(std::ceil(full.height() * scale))};
+}
+
+// what a reduced decode through read takes from the budget, asked before anything was read through it
+static size_t decode_estimate(QImageReader & read, uint_fast16_t res, qint64 encoded_size) {
+	QSize const full = read.size();
+	if (!full.isValid() || full.isEmpty()) return static_cast<size_t>(encoded_size) * unknown_expansion;
+	QSize const scaled = reduced_size(full, res);
+	return decode_footprint(full, scaled, scaled == full || read.supportsOption(QImageIOHandler::ScaledSize));
+}
+
+// mapped files are hashed in place and the rest is streamed, a file is never held in memory just to be hashed
+static uint64_t hash_file(QFile & file, uchar const * map) {
+	xxhash64 hash {};
+	if (map) hash.update(map, file.size());
+	else {
+		file.seek(0);
+		char buffer[65536];
+		qint64 len;
+		while ((len = file.read(buffer, sizeof(buffer))) > 0) hash.update(buffer, len);
+	}
+	CuttleTrace::count(CuttleCounter::bytes_read, file.size());
+	return hash.digest();
+}
+
+// a file ready for decoding, the lease covers the mapping and the decode
+struct mapped_t {
+	std::unique_ptr<QFile> file; // owns the mapping bytes points into, empty bytes decode from the path
+	QByteArray bytes;
+	CuttleBudget::Lease lease;
+};
+
+// Probes the header, waits for the budget, maps and hashes the file of set. Videos, archives and the like in a photo tree
+// cost a header probe rather than a full read. False when the file is no image Qt can read.
+static bool map_image(CuttleSet & set, uint_fast16_t res, mapped_t & out) {
+	auto file = std::make_unique<QFile>(set.filename);
+	if (!file->open(QIODevice::ReadOnly) || file->size() <= 0) return false;
+	size_t estimate;
+	{
+		QImageReader probe {file.get()};
+		setup_reader(probe);
+		if (!probe.canRead()) return false;
+		estimate = decode_estimate(probe, res, file->size());
+	}
+	out.lease = CuttleBudget::instance().acquire(estimate + file->size());
+	uchar * map = file->map(0, file->size());
+	set.file_hash = hash_file(*file, map);
+	if (map) {
+		out.bytes = QByteArray::fromRawData(reinterpret_cast<char const *>(map), file->size());
+		out.file = std::move(file);
 	}
+	return true;
+}
+
+// walks every root file by file, with more than one root each root is its own nonzero group
+static void enumerate_roots(QList<CuttleDirectory> const & roots, std::function<void(QString &&, uint_fast32_t)> const & func) {
+	uint_fast32_t group_id = roots.size() > 1 ? 1 : 0;
+	for (CuttleDirectory const & dir : roots) {
+		CuttleTraceSpan span {"enumerate directory"};
+		QDirIterator diter {dir.dir, QDir::Files, dir.recursive ? QDirIterator::Subdirectories : QDirIterator::NoIteratorFlags};
+		while (diter.hasNext()) func(diter.next(), group_id);
+		group_id++;
+	}
+}
+
+CuttleProcessor::CuttleProcessor(QObject * parent) : QObject(parent) {
+	watcher = new QFileSystemWatcher {this};
+	rescan_timer = new QTimer {this};
+	rescan_timer->setSingleShot(true);
+	rescan_timer->setInterval(500); // file managers and downloads touch a directory many times in a row
+	connect(watcher, &QFileSystemWatcher::directoryChanged, this, [this](QString const & path){
+		dirty_dirs.insert(QDir::cleanPath(path));
+		rescan_timer->start();
+	});
+	connect(rescan_timer, &QTimer::timeout, this, &CuttleProcessor::rescan);
+	settle_timer = new QTimer {this};
+	settle_timer->setSingleShot(true);
+	settle_timer->setInterval(settle_delay);
+	connect(settle_timer, &QTimer::timeout, this, &CuttleProcessor::settle);
+}
+
+CuttleProcessor::~CuttleProcessor() {
+	worker_run.store(false);
+	if (worker.valid()) worker.wait();
+	if (cache.isDirty() && !cache_path.isEmpty()) cache.save(cache_path); // whatever rescans left unsaved
 }
 
 void CuttleProcessor::beginProcessing(QList<CuttleDirectory> const & dirs, size_t res) {
@@ -34,148 +156,275 @@ void CuttleProcessor::beginProcessing(QList<CuttleDirectory> const & dirs, size_
 	emit started();
 	emit section("Preparing...");
 	emit max(0);
-	if (worker) {
-		worker_run.store(false);
-		if (worker->joinable()) worker->join();
-		delete worker;
-	}
+	worker_run.store(false);
+	if (worker.valid()) worker.wait();
 	sets.clear();
+	sets_by_id.clear();
+	matches.clear();
+	ranking.clear();
+	signatures.clear();
 	
-	if (match_data_size) {
-		for (size_t i = 1; i < match_data_size; i++) {
-			delete [] match_data_fast[i];
-		}
-		delete [] match_data_fast;
-	}
+	generation++;
+	rescan_busy = false;
+	roots = dirs;
+	roots_res = res;
+	dirty_dirs.clear();
+	settling.clear();
+	// only the roots are watched until the walkers have listed the subdirectories
+	QStringList const old_dirs = tree_dirs.values();
+	QStringList root_dirs {};
+	for (CuttleDirectory const & dir : roots) root_dirs.append(QDir::cleanPath(dir.dir));
+	watchTree(root_dirs, old_dirs);
 	
 	worker_run.store(true);
-	worker = new std::thread {[&, res](){
+	worker = CuttlePool::instance().submit([&, res, gen = generation](){
 		
-		std::atomic_uint_fast32_t group_id {0};
-		if (dirs.size() > 1) group_id++;
+		signatures.reset(0, res);
 		
-		for (CuttleDirectory const & dir : dirs) {
-			QDirIterator diter {dir.dir, QDir::Files, dir.recursive ? QDirIterator::Subdirectories : QDirIterator::NoIteratorFlags};
-			while (diter.hasNext()) {
-				CuttleSet set {diter.next()};
-				set.group = group_id;
-				sets.push_back(std::move(set));
-			}
-			group_id++;
+		if (!cache_loaded && !cache_path.isEmpty()) {
+			CuttleTraceSpan span {"load cache"};
+			emit section("Loading cache...");
+			cache.load(cache_path);
+			cache_loaded = true;
 		}
+		cache.beginListing();
 		
-		if (!this->worker_run) return;
+		std::atomic_bool discovering {true};
+		std::atomic_uint_fast32_t discovered {0};
 		
-		typedef std::vector<CuttleSet>::iterator cuiter;
+		rw_spinlock emitlk;
+		std::chrono::high_resolution_clock::time_point emit_limiter = std::chrono::high_resolution_clock::now();
+		auto emit_progress = [&](int progress){
+			if (!emitlk.write_lock_try()) return;
+			std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
+			if (now - emit_limiter > std::chrono::milliseconds(125)) {
+				if (discovering) emit max(discovered);
+				emit value(progress);
+				emit_limiter = now;
+				CuttleTrace::sample();
+			}
+			emitlk.write_unlock();
+		};
 		
-		cuiter iter = sets.begin();
-		std::vector<CuttleSet *> toRem {};
-		rw_spinlock sublk, emitlk;
 		emit section("Loading images... %p%");
 		emit value(0);
-		emit max(sets.size());
-		int img_i = 0;
+		emit max(0);
 		
-		std::atomic_uint_fast32_t id {0};
-		std::chrono::high_resolution_clock::time_point emit_limiter = std::chrono::high_resolution_clock::now();
+		// discovery, reading and decoding overlap: walkers hand every file on as soon as they list it, readers probe the
+		// header, map the file and hash it, decoders build the signature from the mapping. The bounded queues make a stage
+		// that runs ahead wait.
+		struct dir_t { QString path; uint_fast32_t group; bool recursive; };
+		struct encoded_t {
+			CuttleSet * set;
+			mapped_t image; // the lease is taken before the item is queued
+		};
+		size_t const decoder_count = CuttlePool::instance().getThreadCount();
+		CuttleQueue<dir_t> dir_queue {std::numeric_limits<size_t>::max(), walker_count};
+		CuttleQueue<CuttleSet *> file_queue {file_queue_size, walker_count};
+		CuttleQueue<encoded_t> encoded_queue {std::max<size_t>(decoder_count * 2, 4), reader_count};
+		auto abort_all = [&](){
+			dir_queue.abort();
+			file_queue.abort();
+			encoded_queue.abort();
+		};
+		
+		// directories still listed or queued, the walker finishing the last one closes the directory queue
+		std::atomic_size_t outstanding {static_cast<size_t>(roots.size())};
+		uint_fast32_t group_id = roots.size() > 1 ? 1 : 0;
+		for (CuttleDirectory const & dir : roots) dir_queue.push({dir.dir, group_id++, dir.recursive});
+		auto close_dirs = [&](){ for (size_t i = 0; i < walker_count; i++) dir_queue.done(); };
+		if (roots.isEmpty()) close_dirs();
+		
+		std::mutex sets_lk;
+		std::mutex dirs_lk;
+		QStringList found_dirs {};
+		std::mutex dupe_lk;
+		std::unordered_map<uint64_t, CuttleSet const *> originals {}; // first set seen with a file hash
+		std::vector<std::pair<CuttleSet *, CuttleSet const *>> to_copy {}; // duplicate, original
+		
+		// true when set is a byte identical copy of a file claimed earlier, restored sets only register themselves
+		auto claim = [&](CuttleSet * set, bool restored) -> bool {
+			if (!set->file_hash) return false;
+			std::lock_guard<std::mutex> guard {dupe_lk};
+			auto iter = originals.emplace(set->file_hash, set);
+			if (iter.second || restored) return false;
+			// files of different sizes can share a hash only through a collision, those are not merged
+			if (iter.first->second->fi.size() != set->fi.size()) return false;
+			to_copy.emplace_back(set, iter.first->second);
+			return true;
+		};
+		
+		std::atomic_uint_fast32_t img_i {0};
+		std::vector<std::future<void>> stages {};
+		auto const run_start = std::chrono::steady_clock::now();
+		run_stats = {};
+		
+		for (size_t w = 0; w < walker_count; w++) stages.push_back(CuttlePool::io().submit([&](){
+			dir_t dir;
+			while (dir_queue.pop(dir)) {
+				CuttleTraceSpan span {"enumerate directory"};
+				QDirIterator diter {dir.path, QDir::Files | QDir::Dirs | QDir::NoDotAndDotDot};
+				while (diter.hasNext()) {
+					if (!worker_run) {
+						abort_all();
+						break;
+					}
+					QString filename = diter.next();
+					QFileInfo const & info = diter.fileInfo();
+					if (info.isDir()) {
+						if (!dir.recursive || info.isSymLink()) continue;
+						{
+							std::lock_guard<std::mutex> guard {dirs_lk};
+							found_dirs.append(QDir::cleanPath(filename));
+						}
+						outstanding++;
+						dir_queue.push({filename, dir.group, true});
+						continue;
+					}
+					CuttleSet * set;
+					{
+						std::lock_guard<std::mutex> guard {sets_lk};
+						set = &sets.emplace_back(filename);
+						set->group = dir.group;
+						set->id = sets.size() - 1;
+					}
+					signatures.resize(set->id + 1);
+					discovered++;
+					file_queue.push(std::move(set));
+				}
+				if (!--outstanding) {
+					run_stats.discovery_seconds = std::chrono::duration<double> {std::chrono::steady_clock::now() - run_start}.count();
+					close_dirs();
+					std::lock_guard<std::mutex> guard {dirs_lk};
+					QMetaObject::invokeMethod(this, [this, gen, found = std::move(found_dirs)](){
+						if (gen == generation) watchTree(found, {});
+					}, Qt::QueuedConnection);
+				}
+			}
+			file_queue.done();
+		}));
 		
-		std::vector<std::thread *> subworkers;
-		for (uint i = 0; i < std::thread::hardware_concurrency(); i++) subworkers.push_back(new std::thread([&](){
-			while (this->worker_run) {
-				sublk.write_lock();
-				if (iter == sets.end()) {
-					sublk.write_unlock();
+		for (size_t r = 0; r < reader_count; r++) stages.push_back(CuttlePool::io().submit([&](){
+			CuttleSet * set;
+			while (file_queue.pop(set)) {
+				if (!worker_run) {
+					abort_all();
 					break;
 				}
-				cuiter set = iter++;
-				
-				if (emitlk.write_lock_try()) {
-					std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
-					if (now - emit_limiter > std::chrono::milliseconds(125)) {
-						emit value(img_i);
-						emit_limiter = now;
-					}
-					emitlk.write_unlock();
+				CuttleTraceSpan span {"read file"};
+				set->fi.size(); // cached before the set is shared, claim compares sizes across threads
+				if (cache.restore(*set, signatures)) {
+					CuttleTrace::count(CuttleCounter::cache_hits);
+					cache.restoreFileHash(*set);
+					claim(set, true);
+					emit_progress(++img_i);
+					continue;
+				}
+				if (cache.isFailure(set->fi)) {
+					CuttleTrace::count(CuttleCounter::cache_hits);
+					set->delete_me = true;
+					emit_progress(++img_i);
+					continue;
+				}
+				CuttleTrace::count(CuttleCounter::cache_misses);
+				// the reader waits for the budget rather than the decoder, so everything queued or decoding already holds its
+				// share and can always finish
+				encoded_t item {set, {}};
+				if (!map_image(*set, res, item.image)) {
+					CuttleTrace::count(CuttleCounter::decode_failures);
+					cache.storeFailure(*set);
+					set->delete_me = true;
+					emit_progress(++img_i);
+					continue;
+				}
+				if (claim(set, false)) {
+					emit_progress(++img_i);
+					continue;
 				}
-				img_i++;
-				
-				sublk.write_unlock();
-				CuttleSet & setref = const_cast<CuttleSet &>(*set); // FIXME -- Why do I have to do this? I'm not using a const_iterator yet it's only giving me const references...
+				encoded_queue.push(std::move(item));
+			}
+			encoded_queue.done();
+		}));
+		
+		CuttlePool::instance().parallel_for(decoder_count, [&](size_t){
+			encoded_t item;
+			while (encoded_queue.pop(item)) {
+				if (!worker_run) {
+					abort_all();
+					break;
+				}
+				CuttleTraceSpan span {"load image"};
 				try {
-					setref.generate(res);
-					setref.id = id++;
+					item.set->generate(signatures, item.image.bytes.isEmpty() ? nullptr : &item.image.bytes, true);
+					cache.store(*item.set, signatures);
 				} catch (CuttleNullImageException) {
-					setref.delete_me = true;
+					CuttleTrace::count(CuttleCounter::decode_failures);
+					cache.storeFailure(*item.set);
+					item.set->delete_me = true;
 				}
+				item.image = {}; // unmaps and returns the budget
+				emit_progress(++img_i);
 			}
-		}));
-		for (std::thread * sw : subworkers) {
-			if (sw->joinable()) sw->join();
-			delete sw;
+		}, &worker_run);
+		
+		if (!worker_run) abort_all();
+		for (std::future<void> & stage : stages) stage.wait();
+		discovering = false;
+		run_stats.files = discovered;
+		emit max(discovered);
+		emit value(img_i);
+		
+		for (auto const & copy : to_copy) {
+			CuttleSet & dup = *copy.first;
+			CuttleSet const & orig = *copy.second;
+			if (orig.delete_me || orig.res != res) {
+				dup.delete_me = true;
+				continue;
+			}
+			dup.copySignature(orig, signatures);
+			cache.store(dup, signatures);
 		}
-		subworkers.clear();
 		
-		match_data_size = id;
-		match_data_fast = new CuttleMatchData * [match_data_size] {nullptr};
-		for (uint_fast32_t x = 1; x < match_data_size; x++) {
-			match_data_fast[x] = new CuttleMatchData [x] {};
+		// only a listing that ran to the end tells which files are gone
+		if (worker_run) cache.evictUnlisted(roots);
+		if (cache.isDirty() && !cache_path.isEmpty()) {
+			CuttleTraceSpan span {"save cache"};
+			emit section("Saving cache...");
+			cache.save(cache_path);
+			cache_saved = std::chrono::steady_clock::now();
 		}
 		
+		matches.reset(signatures.getCount(), match_floor, match_top_k);
+		
 		emit max(1);
 		emit value(1);
 		
 		sets.erase(std::remove_if(sets.begin(), sets.end(), [](CuttleSet & v){return v.delete_me;}), sets.end());
+		auto by_group = [](CuttleSet const & a, CuttleSet const & b){ return a.group < b.group; };
+		if (!std::is_sorted(sets.begin(), sets.end(), by_group)) std::stable_sort(sets.begin(), sets.end(), by_group);
+		rebuildIndex();
 		
-		int cmax = 0;
-		for (uint i = 1; i <= sets.size(); i++) cmax += i;
 		emit section("Generating deltas... %p%");
 		emit value(0);
-		emit max(cmax);
-		img_i = 0;
-		
-		cuiter iterA = sets.begin();
-		cuiter iterB = iterA;
-		
-		for (uint i = 0; i < std::thread::hardware_concurrency(); i++) subworkers.push_back(new std::thread([&](){
-			while (this->worker_run) {
-				cuiter curA, curB;
-				sublk.write_lock();
-				if (iterB == sets.end()) iterB = iterA++;
-				if (iterA == sets.end()) {
-					sublk.write_unlock();
-					break;
-				}
-				curA = iterA;
-				curB = iterB++;
-				
-				if (emitlk.write_lock_try()) {
-					std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
-					if (now - emit_limiter > std::chrono::milliseconds(125)) {
-						emit value(img_i);
-						emit_limiter = now;
-					}
-					emitlk.write_unlock();
-				}
-				img_i++;
-				
-				sublk.write_unlock();
-				if (curA == curB) continue;
-				if (curA->group && curB->group && curA->group == curB->group)
-					continue;
-				
-				CuttleMatchData val = CuttleSet::compare(curA.base(), curB.base());
-				
-				if (curA->id > curB->id) {
-					match_data_fast[curA->id][curB->id] = val;
-				} else {
-					match_data_fast[curB->id][curA->id] = val;
-				}
-			}
-		}));
-		for (std::thread * sw : subworkers) {
-			if (sw->joinable()) sw->join();
-			delete sw;
+		
+		switch (search_mode) {
+			case CuttleSearchMode::exhaustive:
+				run_stats.pairs_compared = compareAll(emit_progress);
+				break;
+			case CuttleSearchMode::phash:
+				run_stats.pairs_compared = compareHashCandidates(emit_progress);
+				break;
+			case CuttleSearchMode::histogram:
+				run_stats.pairs_compared = compareHistogramNeighbours(emit_progress);
+				break;
+		}
+		
+		{
+			CuttleTraceSpan span {"finalize matches"};
+			matches.finalize();
+			rebuildIndex();
 		}
+		CuttleTrace::flush();
 		
 		if (worker_run) { // completed successfully
 			emit section("Complete");
@@ -184,62 +433,552 @@ void CuttleProcessor::beginProcessing(QList<CuttleDirectory> const & dirs, size_
 			emit finished();
 		} else { // stopped
 			sets.clear();
+			sets_by_id.clear();
+			ranking.clear();
 			emit section("Stopped");
 			emit value(1);
 			emit max(1);
 			emit finished();
 		}
-	}};
+	});
 }
 
-double CuttleProcessor::getHigh(CuttleSet const * set) const {
-	double high = 0;
-	for (auto const & i : sets) {
-		if (set->id == i.id) continue;
-		double val = getMatchData(&i, set).value;
-		if (val > high) high = val;
+void CuttleProcessor::setWatch(bool watch) {
+	if (watch == this->watch) return;
+	this->watch = watch;
+	QStringList const watched = watcher->directories();
+	if (!watched.isEmpty()) watcher->removePaths(watched);
+	if (watch && !tree_dirs.isEmpty()) watcher->addPaths(tree_dirs.values());
+}
+
+// QFileSystemWatcher only reports direct children, so recursive roots get every subdirectory watched as well. The
+// directories come from the run's walkers and from rescans, the tree is never listed again just to watch it.
+void CuttleProcessor::watchTree(QStringList const & added, QStringList const & gone) {
+	// the watcher drops deleted directories by itself, only the ones still watched are removed
+	QSet<QString> watching {};
+	if (watch) {
+		QStringList const watched = watcher->directories();
+		watching = {watched.begin(), watched.end()};
+	}
+	QStringList stale {}, fresh {};
+	for (QString const & path : gone) if (tree_dirs.remove(path) && watching.contains(path)) stale.append(path);
+	for (QString const & path : added) if (!tree_dirs.contains(path)) {
+		tree_dirs.insert(path);
+		fresh.append(path);
+	}
+	if (!watch) return;
+	if (!stale.isEmpty()) watcher->removePaths(stale);
+	if (!fresh.isEmpty()) watcher->addPaths(fresh);
+}
+
+// Only the directories the watcher reported are listed again. Files that are new or whose size or modification time
+// changed are admitted as new sets, files that are gone or changed tombstone their old set.
+void CuttleProcessor::rescan() {
+	// a stopped run cleared its sets, and a stop during a rescan holds until the next run as well
+	if (!watch || !worker_run || dirty_dirs.isEmpty()) return;
+	if (rescan_busy || (worker.valid() && worker.wait_for(std::chrono::seconds {0}) != std::future_status::ready)) {
+		rescan_timer->start(); // a run or an earlier rescan is still going, try again once it settles
+		return;
 	}
-	return high;
+	
+	struct known_t {
+		uint32_t id;
+		qint64 size;
+		qint64 mtime;
+		QString dir;
+		bool dead; // tombstoned or failed to load, only a change of the file brings it back
+	};
+	QSet<QString> dirs = std::move(dirty_dirs);
+	dirty_dirs.clear();
+	// the known directories in or below the reported ones, any of them may have been deleted or moved away
+	QSet<QString> below {};
+	for (QString const & path : tree_dirs) {
+		for (QString const & dir : dirs) if (path == dir || path.startsWith(dir + '/')) {
+			below.insert(path);
+			break;
+		}
+	}
+	QHash<QString, known_t> known {};
+	for (CuttleSet const & set : sets) {
+		QString dir = QDir::cleanPath(set.fi.path());
+		if (!dirs.contains(dir) && !below.contains(dir)) continue;
+		// a file can have a live set and older dead ones, the live one speaks for it
+		QString key = QDir::cleanPath(set.filename);
+		auto iter = known.find(key);
+		if (iter != known.end() && !iter->dead) continue;
+		known.insert(key, {static_cast<uint32_t>(set.id), set.fi.size(), set.fi.lastModified().toMSecsSinceEpoch(), std::move(dir), set.delete_me});
+	}
+	
+	rescan_busy = true;
+	worker = CuttlePool::instance().submit([this, gen = generation, scan_roots = roots, dirs, below, known]() mutable {
+		CuttleTraceSpan span {"rescan directories"};
+		std::vector<std::pair<QString, uint_fast32_t>> added {};
+		std::vector<uint32_t> removed {};
+		QStringList new_dirs {}, gone_dirs {};
+		QSet<QString> listed = dirs;
+		
+		for (QString const & path : below) if (!QFileInfo {path}.isDir()) {
+			gone_dirs.append(path);
+			listed.insert(path); // nothing is left in it
+		}
+		
+		auto visit = [&](QString const & filename, uint_fast32_t group){
+			QString key = QDir::cleanPath(filename);
+			auto iter = known.find(key);
+			QFileInfo fi {key};
+			if (iter != known.end()) {
+				bool same = fi.size() == iter->size && fi.lastModified().toMSecsSinceEpoch() == iter->mtime;
+				if (!same && !iter->dead) removed.push_back(iter->id);
+				known.erase(iter);
+				if (same) return;
+			} else if (cache.isFailure(fi)) return; // the full run drops the sets of files that failed, the cache remembers them
+			added.emplace_back(std::move(key), group);
+		};
+		
+		for (QString const & path : dirs) {
+			// the first root holding the directory decides its group, the same order the full run enumerates in
+			int root = -1;
+			for (int i = 0; i < scan_roots.size() && root < 0; i++) {
+				QString base = QDir::cleanPath(scan_roots[i].dir);
+				if (path == base || (scan_roots[i].recursive && path.startsWith(base + '/'))) root = i;
+			}
+			if (root < 0) continue;
+			uint_fast32_t const group = scan_roots.size() > 1 ? root + 1 : 0;
+			
+			QDirIterator files {path, QDir::Files};
+			while (files.hasNext()) visit(files.next(), group);
+			if (!scan_roots[root].recursive) continue;
+			// directories created or moved in since the last listing were never watched, their whole tree is new
+			QDirIterator subdirs {path, QDir::Dirs | QDir::NoDotAndDotDot};
+			while (subdirs.hasNext()) {
+				QString sub = QDir::cleanPath(subdirs.next());
+				if (below.contains(sub) || subdirs.fileInfo().isSymLink()) continue;
+				new_dirs.append(sub);
+				QDirIterator tree {sub, QDir::Dirs | QDir::NoDotAndDotDot, QDirIterator::Subdirectories};
+				while (tree.hasNext()) new_dirs.append(QDir::cleanPath(tree.next()));
+				enumerate_roots({{sub, true}}, [&](QString && filename, uint_fast32_t){ visit(filename, group); });
+			}
+		}
+		// files below a reported directory that was not listed itself are only gone when their directory is
+		for (known_t const & gone : known) if (!gone.dead && listed.contains(gone.dir)) removed.push_back(gone.id);
+		
+		QMetaObject::invokeMethod(this, [this, gen, added = std::move(added), removed = std::move(removed), new_dirs = std::move(new_dirs), gone_dirs = std::move(gone_dirs)]() mutable {
+			rescanAdmit(gen, std::move(added), std::move(removed), std::move(new_dirs), std::move(gone_dirs));
+		}, Qt::QueuedConnection);
+	});
+}
+
+void CuttleProcessor::rescanAdmit(uint_fast32_t gen, std::vector<std::pair<QString, uint_fast32_t>> added, std::vector<uint32_t> removed, QStringList new_dirs, QStringList gone_dirs) {
+	if (gen != generation) return;
+	watchTree(new_dirs, gone_dirs);
+	if (!worker_run || (added.empty() && removed.empty())) {
+		rescan_busy = false;
+		return;
+	}
+	
+	std::unordered_set<uint32_t> const gone {removed.begin(), removed.end()};
+	std::vector<CuttleSet const *> live {};
+	for (CuttleSet & set : sets) {
+		if (gone.count(set.id)) set.delete_me = true;
+		if (!set.delete_me) live.push_back(&set);
+	}
+	// only the removed sets and their neighbours change rank
+	std::vector<uint32_t> touched {removed.begin(), removed.end()};
+	for (uint32_t id : removed) {
+		if (id < sets_by_id.size()) sets_by_id[id] = nullptr;
+		if (id >= matches.getSize()) continue;
+		for (auto n = matches.neighboursBegin(id); n != matches.neighboursEnd(id); n++) touched.push_back(n->id);
+	}
+	ranking.update(matches, sets_by_id, touched);
+	
+	// The deque keeps every existing set in place. The new ones only get an arena slot for now: the store is grown, and so
+	// the index and the ranking list them, once the worker has written their signatures and thumbnails.
+	std::vector<CuttleSet *> fresh {};
+	uint_fast32_t id = signatures.getCount();
+	for (auto & file : added) {
+		CuttleSet set {file.first};
+		set.group = file.second;
+		set.id = id++;
+		sets.push_back(std::move(set));
+		fresh.push_back(&sets.back());
+	}
+	signatures.resize(id);
+	if (!removed.empty()) emit updated({}, removed);
+	
+	worker = CuttlePool::instance().submit([this, gen, fresh = std::move(fresh), live = std::move(live)](){
+		CuttleTraceSpan span {"rescan compare"};
+		std::vector<uint8_t> failed (fresh.size(), false);
+		std::vector<settling_t> loaded (fresh.size());
+		CuttlePool::instance().parallel_for(fresh.size(), [&](size_t i){
+			CuttleTraceSpan span {"load image"};
+			CuttleSet & set = *fresh[i];
+			loaded[i] = {set.filename, set.fi.size(), set.fi.lastModified().toMSecsSinceEpoch(), {}};
+			if (cache.restore(set, signatures)) {
+				CuttleTrace::count(CuttleCounter::cache_hits);
+				cache.restoreFileHash(set);
+				return;
+			}
+			if (cache.isFailure(set.fi)) {
+				CuttleTrace::count(CuttleCounter::cache_hits);
+				failed[i] = true;
+				return;
+			}
+			CuttleTrace::count(CuttleCounter::cache_misses);
+			try {
+				// hashed like the full run, the cache never stores a file without its hash
+				mapped_t image {};
+				if (!map_image(set, signatures.getRes(), image)) throw CuttleNullImageException {};
+				set.generate(signatures, image.bytes.isEmpty() ? nullptr : &image.bytes, true);
+				cache.store(set, signatures);
+			} catch (CuttleNullImageException) {
+				CuttleTrace::count(CuttleCounter::decode_failures);
+				cache.storeFailure(set);
+				failed[i] = true;
+			}
+		}, &worker_run);
+		if (cache.isDirty() && !cache_path.isEmpty() && std::chrono::steady_clock::now() - cache_saved >= cache_save_interval) {
+			cache.save(cache_path);
+			cache_saved = std::chrono::steady_clock::now();
+		}
+		
+		// a handful of new sets against everything already there is cheap enough to score exhaustively in every search mode
+		std::vector<CuttleMatchStore::Edge> edges {};
+		std::mutex edges_lk;
+		CuttlePool::instance().parallel_for(fresh.size(), [&](size_t i){
+			if (failed[i]) return;
+			CuttleTraceSpan span {"compare new set"};
+			thread_local std::vector<CuttleMatchStore::Edge> local {};
+			int_fast64_t compared = 0, skipped = 0;
+			for (CuttleSet const * other : live) {
+				if (comparePair(fresh[i], other, local)) compared++;
+				else skipped++;
+			}
+			for (size_t j = 0; j < i; j++) {
+				if (failed[j]) continue;
+				if (comparePair(fresh[i], fresh[j], local)) compared++;
+				else skipped++;
+			}
+			CuttleTrace::count(CuttleCounter::pairs_compared, compared);
+			CuttleTrace::count(CuttleCounter::pairs_skipped_group, skipped);
+			std::lock_guard<std::mutex> guard {edges_lk};
+			edges.insert(edges.end(), local.begin(), local.end());
+			local.clear();
+		}, &worker_run);
+		
+		std::vector<CuttleSet *> admitted {}, dropped {};
+		for (size_t i = 0; i < fresh.size(); i++) (failed[i] || !worker_run ? dropped : admitted).push_back(fresh[i]);
+		QMetaObject::invokeMethod(this, [this, gen, admitted = std::move(admitted), dropped = std::move(dropped), edges = std::move(edges), loaded = std::move(loaded)]() mutable {
+			rescanFinish(gen, std::move(admitted), std::move(dropped), std::move(edges), std::move(loaded));
+		}, Qt::QueuedConnection);
+	});
+}
+
+void CuttleProcessor::rescanFinish(uint_fast32_t gen, std::vector<CuttleSet *> added, std::vector<CuttleSet *> dropped, std::vector<CuttleMatchStore::Edge> edges, std::vector<settling_t> loaded) {
+	if (gen != generation) return;
+	rescan_busy = false;
+	
+	auto const now = std::chrono::steady_clock::now();
+	for (settling_t & file : loaded) {
+		file.since = now;
+		settling.push_back(std::move(file));
+	}
+	if (!settling.empty() && !settle_timer->isActive()) settle_timer->start();
+	
+	// sets that failed were never published, they only need their tombstone
+	for (CuttleSet * set : dropped) set->delete_me = true;
+	if (!worker_run) edges.clear();
+	
+	// the new sets and the ones they matched are the only ones whose rank can change
+	std::vector<uint32_t> ids {}, touched {};
+	for (CuttleSet const * set : added) ids.push_back(set->id);
+	touched = ids;
+	for (CuttleMatchStore::Edge const & edge : edges) {
+		touched.push_back(edge.A);
+		touched.push_back(edge.B);
+	}
+	matches.grow(signatures.getCount());
+	matches.merge(edges);
+	sets_by_id.resize(matches.getSize(), nullptr);
+	for (CuttleSet const * set : added) sets_by_id[set->id] = set;
+	ranking.update(matches, sets_by_id, touched);
+	if (!ids.empty()) emit updated(ids, {});
+	
+	if (!dirty_dirs.isEmpty()) rescan_timer->start();
+}
+
+// Directory watches report files appearing, not the writes that follow, so a file admitted while it was still being
+// written would keep a signature of its truncated head. Every file a rescan loaded is looked at again after
+// settle_delay, and the directory of one whose size or modification time moved is rescanned, which replaces its set.
+void CuttleProcessor::settle() {
+	auto const now = std::chrono::steady_clock::now();
+	std::vector<settling_t> pending {};
+	for (settling_t & file : settling) {
+		if (now - file.since < settle_delay) {
+			pending.push_back(std::move(file));
+			continue;
+		}
+		QFileInfo const fi {file.filename};
+		if (!fi.exists()) continue; // deleted, its directory reports that
+		if (fi.size() == file.size && fi.lastModified().toMSecsSinceEpoch() == file.mtime) continue;
+		dirty_dirs.insert(QDir::cleanPath(fi.path()));
+	}
+	settling = std::move(pending);
+	if (!dirty_dirs.isEmpty() && !rescan_timer->isActive()) rescan_timer->start();
+	if (!settling.empty()) settle_timer->start();
+}
+
+// scores one pair and keeps it if the store would, returns false for pairs skipped by group
+inline bool CuttleProcessor::comparePair(CuttleSet const * A, CuttleSet const * B, std::vector<CuttleMatchStore::Edge> & edges) const {
+	if (A->group && B->group && A->group == B->group) return false;
+	CuttleMatchData val = CuttleSet::compare(signatures, A, B, matches.getFloor());
+	if (matches.accepts(val)) edges.push_back({static_cast<uint32_t>(A->id), static_cast<uint32_t>(B->id), val});
+	return true;
+}
+
+uint_fast64_t CuttleProcessor::compareAll(std::function<void(int)> const & progress) {
+	// Sets are ordered by group, so every group is one contiguous range. Group 0 compares against everything, including
+	// itself, which gives the lower triangle of its range. Every pair of ranges adds the full rectangle between them, unless
+	// both share a nonzero group. Each block is cut into square tiles of delta_tile_size sets, and one tile is one unit of work.
+	struct block_t {
+		uint_fast32_t beginA, endA, beginB, endB;
+		uint_fast32_t tilesB; // 0 for a triangle
+		uint_fast64_t first_tile;
+	};
+	
+	std::vector<std::pair<uint_fast32_t, uint_fast32_t>> ranges {};
+	for (uint_fast32_t i = 0; i < sets.size(); i++) {
+		if (!i || sets[i].group != sets[i - 1].group) ranges.emplace_back(i, i);
+		ranges.back().second = i + 1;
+	}
+	
+	auto tiles = [](uint_fast32_t count) -> uint_fast64_t { return (count + delta_tile_size - 1) / delta_tile_size; };
+	std::vector<block_t> blocks {};
+	uint_fast64_t tile_count = 0;
+	for (size_t i = 0; i < ranges.size(); i++) {
+		auto const & rA = ranges[i];
+		if (!sets[rA.first].group) {
+			uint_fast64_t t = tiles(rA.second - rA.first);
+			blocks.push_back({rA.first, rA.second, rA.first, rA.second, 0, tile_count});
+			tile_count += t * (t + 1) / 2;
+		}
+		for (size_t j = 0; j < i; j++) {
+			auto const & rB = ranges[j];
+			if (sets[rA.first].group && sets[rA.first].group == sets[rB.first].group) continue;
+			uint_fast32_t tB = tiles(rB.second - rB.first);
+			blocks.push_back({rA.first, rA.second, rB.first, rB.second, tB, tile_count});
+			tile_count += tiles(rA.second - rA.first) * tB;
+		}
+	}
+	
+	std::atomic_uint_fast64_t tiles_done {0};
+	std::atomic_uint_fast64_t scored {0};
+	std::vector<CuttleSet const *> set_data (sets.size());
+	for (size_t i = 0; i < sets.size(); i++) set_data[i] = &sets[i];
+	
+	emit max(tile_count);
+	
+	CuttlePool::instance().parallel_for(tile_count, [&](size_t tile){
+		CuttleTraceSpan span {"compare tile"};
+		thread_local std::vector<CuttleMatchStore::Edge> edges {};
+		int_fast64_t compared = 0, skipped = 0;
+		
+		block_t const & block = *(std::upper_bound(blocks.begin(), blocks.end(), tile, [](size_t t, block_t const & b){ return t < b.first_tile; }) - 1);
+		uint_fast64_t const local = tile - block.first_tile;
+		uint_fast32_t bA, bB;
+		if (block.tilesB) {
+			bA = local / block.tilesB;
+			bB = local % block.tilesB;
+		} else tile_coords(local, bA, bB);
+		bool const diagonal = !block.tilesB && bA == bB;
+		
+		uint_fast32_t const beginA = block.beginA + bA * delta_tile_size, endA = std::min(beginA + delta_tile_size, block.endA);
+		uint_fast32_t const beginB = block.beginB + bB * delta_tile_size, endB = std::min(beginB + delta_tile_size, block.endB);
+		
+		for (uint_fast32_t a = beginA; a < endA; a++) {
+			for (uint_fast32_t b = beginB; b < (diagonal ? a : endB); b++) {
+				if (comparePair(set_data[a], set_data[b], edges)) compared++;
+				else skipped++;
+			}
+		}
+		CuttleTrace::count(CuttleCounter::pairs_compared, compared);
+		CuttleTrace::count(CuttleCounter::pairs_skipped_group, skipped);
+		scored += compared;
+		// tiles are the unit of work, so every tile hands its edges over before returning
+		matches.insert(edges);
+		progress(++tiles_done);
+	}, &worker_run);
+	return scored;
+}
+
+uint_fast64_t CuttleProcessor::compareHashCandidates(std::function<void(int)> const & progress) {
+	CuttleHashIndex index {};
+	{
+		CuttleTraceSpan span {"build hash index"};
+		std::vector<uint64_t> hashes (sets.size());
+		for (size_t i = 0; i < sets.size(); i++) hashes[i] = signatures.phash(sets[i].id);
+		index.build(std::move(hashes), phash_radius);
+	}
+	
+	std::atomic_uint_fast32_t sets_done {0};
+	std::atomic_uint_fast64_t scored {0};
+	emit max(sets.size());
+	
+	CuttlePool::instance().parallel_for(sets.size(), [&](size_t a){
+		CuttleTraceSpan span {"compare candidates"};
+		thread_local std::vector<CuttleMatchStore::Edge> edges {};
+		int_fast64_t compared = 0, skipped = 0;
+		index.query(a, [&](size_t b){
+			if (comparePair(&sets[a], &sets[b], edges)) compared++;
+			else skipped++;
+		});
+		CuttleTrace::count(CuttleCounter::pairs_compared, compared);
+		CuttleTrace::count(CuttleCounter::pairs_skipped_group, skipped);
+		scored += compared;
+		matches.insert(edges);
+		progress(++sets_done);
+	}, &worker_run);
+	return scored;
+}
+
+uint_fast64_t CuttleProcessor::compareHistogramNeighbours(std::function<void(int)> const & progress) {
+	// Hellinger embedding, the arena already holds the square roots of the L1 normalized histograms which turn Bhattacharyya
+	// similarity into euclidean distance
+	static constexpr size_t dims = CuttleSignatureArena::hist_size;
+	CuttleVPTree tree {};
+	{
+		CuttleTraceSpan span {"build histogram index"};
+		std::vector<float> points (sets.size() * dims);
+		for (size_t i = 0; i < sets.size(); i++) {
+			float const * hist = signatures.hist(sets[i].id);
+			std::copy(hist, hist + dims, points.data() + i * dims);
+		}
+		tree.build(std::move(points), dims);
+	}
+	
+	std::vector<std::vector<uint32_t>> neighbours (sets.size());
+	std::atomic_uint_fast32_t sets_done {0};
+	std::atomic_uint_fast64_t scored {0};
+	emit max(sets.size() * 2);
+	
+	CuttlePool::instance().parallel_for(sets.size(), [&](size_t a){
+		CuttleTraceSpan span {"histogram neighbours"};
+		tree.query(a, hist_neighbours, [&](uint32_t b){
+			return !(sets[a].group && sets[b].group && sets[a].group == sets[b].group);
+		}, neighbours[a]);
+		progress(++sets_done);
+	}, &worker_run);
+	
+	CuttlePool::instance().parallel_for(sets.size(), [&](size_t a){
+		CuttleTraceSpan span {"compare neighbours"};
+		thread_local std::vector<CuttleMatchStore::Edge> edges {};
+		int_fast64_t compared = 0;
+		for (uint32_t b : neighbours[a]) {
+			// mutual neighbours are only scored from the lower index
+			if (b < a && std::find(neighbours[b].begin(), neighbours[b].end(), a) != neighbours[b].end()) continue;
+			comparePair(&sets[a], &sets[b], edges);
+			compared++;
+		}
+		CuttleTrace::count(CuttleCounter::pairs_compared, compared);
+		scored += compared;
+		matches.insert(edges);
+		progress(++sets_done);
+	}, &worker_run);
+	return scored;
+}
+
+double CuttleProcessor::getHigh(CuttleSet const * set) const {
+	return static_cast<double>(getHighScore(set)) / CuttleMatchData::score_max;
+}
+
+uint16_t CuttleProcessor::getHighScore(CuttleSet const * set) const {
+	return set->delete_me ? 0 : ranking.getBest(set->id);
+}
+
+// keeps the sets whose score passes, best first, scores stay in their 16 bit form throughout
+static std::vector<CuttleSet const *> sorted_above(std::vector<std::pair<uint16_t, CuttleSet const *>> & found) {
+	std::stable_sort(found.begin(), found.end(), [](auto const & a, auto const & b){ return a.first > b.first; });
+	std::vector<CuttleSet const *> vec (found.size());
+	std::transform(found.begin(), found.end(), vec.begin(), [](auto const & f){ return f.second; });
+	return vec;
 }
 
 std::vector<CuttleSet const *> CuttleProcessor::getSetsAboveThresh(double high) const {
+	auto const & ranked = ranking.getSets();
+	size_t const count = ranking.setsAbove(CuttleMatchData::quantize(high));
 	std::vector<CuttleSet const *> vec {};
-	for (auto const & i : sets) {
-		if (getHigh(&i) >= high) vec.push_back(&i);
-	}
+	vec.reserve(count);
+	for (size_t i = 0; i < count; i++) vec.push_back(sets_by_id[ranked[i].id]);
 	return vec;
 }
 
+// only the stored neighbours of comp can pass, everything else scored below the floor
 std::vector<CuttleSet const *> CuttleProcessor::getSetsAboveThresh(CuttleSet const * comp, double thresh) const {
-	std::vector<CuttleSet const *> vec {};
-	for (auto const & i : sets) {
-		if (comp->id == i.id) continue;
-		if (getMatchData(&i, comp).value >= thresh) vec.push_back(&i);
+	uint16_t const score = CuttleMatchData::quantize(thresh);
+	std::vector<std::pair<uint16_t, CuttleSet const *>> found {};
+	if (comp->id >= matches.getSize()) return {};
+	for (auto n = matches.neighboursBegin(comp->id); n != matches.neighboursEnd(comp->id); n++) {
+		CuttleSet const * other = sets_by_id[n->id];
+		if (!other) continue;
+		uint16_t s = getMatchData(other, comp).score();
+		if (s >= score) found.emplace_back(s, other);
 	}
+	return sorted_above(found);
+}
+
+std::vector<CuttleMatchPair> CuttleProcessor::getPairsAboveThresh(double thresh) const {
+	auto const & ranked = ranking.getEdges();
+	size_t const count = ranking.edgesAbove(CuttleMatchData::quantize(thresh));
+	std::vector<CuttleMatchPair> vec {};
+	vec.reserve(count);
+	for (size_t i = 0; i < count; i++) vec.push_back({sets_by_id[ranked[i].A], sets_by_id[ranked[i].B], ranked[i].data});
 	return vec;
 }
 
+std::vector<std::vector<CuttleSet const *>> CuttleProcessor::getClustersAboveThresh(double thresh) const {
+	std::vector<std::vector<CuttleSet const *>> vec {};
+	for (auto const & ids : ranking.clusters(CuttleMatchData::quantize(thresh))) {
+		vec.emplace_back(ids.size());
+		std::transform(ids.begin(), ids.end(), vec.back().begin(), [this](uint32_t id){ return sets_by_id[id]; });
+	}
+	return vec;
+}
+
+void CuttleProcessor::rebuildIndex() {
+	sets_by_id.assign(matches.getSize(), nullptr);
+	for (CuttleSet const & set : sets) {
+		if (!set.delete_me && set.id < sets_by_id.size()) sets_by_id[set.id] = &set;
+	}
+	ranking.build(matches, sets_by_id);
+}
+
+// removed sets are tombstoned rather than erased, so pointers held by the lists and by a running rescan stay valid
 void CuttleProcessor::remove(CuttleSet const * set) {
 	emit started();
-	sets.erase(std::remove_if(sets.begin(), sets.end(), [&set](CuttleSet & v){return v.id == set->id;}), sets.end());
+	if (set->id < sets_by_id.size() && sets_by_id[set->id] == set) {
+		const_cast<CuttleSet *>(set)->delete_me = true;
+		sets_by_id[set->id] = nullptr;
+		std::vector<uint32_t> touched {static_cast<uint32_t>(set->id)};
+		for (auto n = matches.neighboursBegin(set->id); n != matches.neighboursEnd(set->id); n++) touched.push_back(n->id);
+		ranking.update(matches, sets_by_id, touched);
+	}
 	emit finished();
 }
 
 void CuttleProcessor::remove(CuttleSet const * setA, CuttleSet const * setB) {
 	emit started();
 	//sets.erase(std::remove_if(sets.begin(), sets.end(), [&](CuttleSet & v){return v.id == setA->id || v.id == setB->id;}), sets.end());
-	if (setA->id > setB->id) match_data_fast[setA->id][setB->id] = invalid_match;
-	else match_data_fast[setB->id][setA->id] = invalid_match;
+	matches.invalidate(setA->id, setB->id);
+	ranking.update(matches, sets_by_id, {static_cast<uint32_t>(setA->id), static_cast<uint32_t>(setB->id)});
 	emit finished();
 }
 
 void CuttleProcessor::remove_all_idential() {
 	emit started();
 	auto iter = sets.begin();
-	std::vector<std::vector<CuttleSet>::iterator> iter_set;
+	std::vector<std::deque<CuttleSet>::iterator> iter_set;
 	while (iter != sets.end()) {
 		for (auto const & iter2 : sets) {
-			if (iter->id != iter2.id && getMatchData(*iter, iter2).value == 1) {
+			if (iter->id != iter2.id && getMatchData(*iter, iter2).score() == CuttleMatchData::score_max) {
 				qDebug() << "MATCH";
 			}
 		}
@@ -251,104 +990,203 @@ void CuttleProcessor::remove_all_idential() {
 
 QImage CuttleSet::getImage() const {
 	QImageReader read {filename};
-	read.setAllocationLimit(4096);
-	read.setAutoDetectImageFormat(true);
-	read.setDecideFormatFromContent(true);
+	setup_reader(read);
 	QImage img = read.read();
 	*const_cast<QSize *>(&img_size) = img.size();
 	return img;
 }
 
-void CuttleSet::generate(uint_fast16_t res) {
+// decodes at the smallest size that still covers res x res and the thumbnail, letting the format plugin skip work (e.g. JPEG DCT scaling)
+// with lease set the decode is first admitted against the global budget, the lease must outlive the returned image
+QImage CuttleSet::getImageReduced(uint_fast16_t res, QByteArray const * encoded, CuttleBudget::Lease * lease) const {
+	CuttleTraceSpan span {"decode"};
+	QBuffer buffer {};
+	QImageReader read {};
+	if (encoded) {
+		buffer.setData(*encoded);
+		read.setDevice(&buffer);
+	} else read.setFileName(filename);
+	setup_reader(read);
+	if (lease) *lease = CuttleBudget::instance().acquire(decode_estimate(read, res, encoded ? encoded->size() : fi.size()));
+	QSize full = read.size();
+	if (!full.isValid() || full.isEmpty()) {
+		if (!encoded) return getImage();
+		// the header had no size to offer, decode in full from the same bytes
+		QImage img = read.read();
+		*const_cast<QSize *>(&img_size) = img.size();
+		return img;
+	}
+	
+	QSize const scaled = reduced_size(full, res);
+	if (scaled != full) read.setScaledSize(scaled);
+	
+	QImage img = read.read();
+	if (!img.isNull()) *const_cast<QSize *>(&img_size) = full;
+	return img;
+}
+
+namespace {
+	// per-thread accumulators for the signature pass, grown on demand and reused for every image the thread decodes
+	struct signature_scratch {
+		std::vector<uint32_t> grid_sum, thumb_sum; // interleaved R, G, B per destination cell
+		std::vector<uint16_t> grid_x, thumb_x; // destination column of every source column
+		std::vector<uint32_t> grid_w, grid_h, thumb_w, thumb_h; // source columns/rows feeding every destination column/row
+		std::array<uint32_t, 256 * 3> hist;
+	};
+}
+
+static inline void map_axis(uint_fast32_t src, uint_fast32_t dst, std::vector<uint16_t> * index, std::vector<uint32_t> & count) {
+	count.assign(dst, 0);
+	if (index) index->resize(src);
+	for (uint_fast32_t i = 0; i < src; i++) {
+		uint_fast32_t d = static_cast<uint_fast64_t>(i) * dst / src;
+		if (index) (*index)[i] = d;
+		count[d]++;
+	}
+}
+
+void CuttleSet::generate(CuttleSignatureArena & sigs, QByteArray const * encoded, bool admitted) {
 	
+	uint_fast16_t const res = sigs.getRes();
 	if (this->res == res) return;
 	this->res = res;
 	
-	QImage img = getImage();
+	CuttleBudget::Lease lease {};
+	QImage img = getImageReduced(res, encoded, admitted ? nullptr : &lease);
 	if (img.isNull()) {
 		throw CuttleNullImageException {};
 	}
-	thumb = QPixmap::fromImage(img.scaled(THUMB_SIZE, THUMB_SIZE, Qt::KeepAspectRatio, Qt::SmoothTransformation));
-	img = img.scaled({static_cast<int>(res), static_cast<int>(res)}, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
-	data.resize(res * res);
+	if (!encoded) CuttleTrace::count(CuttleCounter::bytes_read, fi.size());
 	
-	QCryptographicHash hash {QCryptographicHash::Sha512};
-	hash.addData(reinterpret_cast<char const *>(img.constBits()), img.sizeInBytes());
-	img_hash = hash.result();
+	QSize const tsize = img.size().scaled(THUMB_SIZE, THUMB_SIZE, Qt::KeepAspectRatio).expandedTo({1, 1});
 	
-	int i = 0;
-	for (uint_fast16_t y = 0; y < res; y++) {
-		for (uint_fast16_t x = 0; x < res; x++) {
-			data[i++] = img.pixelColor(x, y);
-		}
+	// the pass area-averages, so the source must cover both destinations; only tiny images take this detour
+	if (img.width() < std::max<int>(res, tsize.width()) || img.height() < std::max<int>(res, tsize.height())) {
+		CuttleTraceSpan span {"scale"};
+		img = img.scaled(std::max({img.width(), static_cast<int>(res), tsize.width()}), std::max({img.height(), static_cast<int>(res), tsize.height()}), Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
 	}
+	if (img.format() != QImage::Format_RGB32 && img.format() != QImage::Format_ARGB32) img.convertTo(QImage::Format_RGB32);
 	
-	// CV
-	
-	QImage testI = img.convertedTo(QImage::Format_RGB32);
-	std::vector<uint8_t> test;
-	test.reserve(testI.width() * testI.height() * 3);
-	for (int x = 0; x < res; x++) for (int y = 0; y < res; y++) {
-		QRgb c = testI.pixel(x, y);
-		test.push_back( qRed(c) );
-		test.push_back( qGreen(c) );
-		test.push_back( qBlue(c) );
+	// one walk over the decoded scanlines feeds the res x res grid, the thumbnail and the full resolution histograms
+	{
+		CuttleTraceSpan span {"signature pass"};
+		thread_local signature_scratch scratch {};
+		
+		uint_fast32_t const W = img.width(), H = img.height(), TW = tsize.width(), TH = tsize.height();
+		map_axis(W, res, &scratch.grid_x, scratch.grid_w);
+		map_axis(H, res, nullptr, scratch.grid_h);
+		map_axis(W, TW, &scratch.thumb_x, scratch.thumb_w);
+		map_axis(H, TH, nullptr, scratch.thumb_h);
+		scratch.grid_sum.assign(static_cast<size_t>(res) * res * 3, 0);
+		scratch.thumb_sum.assign(TW * TH * 3, 0);
+		scratch.hist.fill(0);
+		
+		uint32_t * const hR = scratch.hist.data(), * const hG = hR + 256, * const hB = hG + 256;
+		uint16_t const * const gx = scratch.grid_x.data(), * const tx = scratch.thumb_x.data();
+		for (uint_fast32_t y = 0; y < H; y++) {
+			QRgb const * line = reinterpret_cast<QRgb const *>(img.constScanLine(y));
+			uint32_t * const gs = scratch.grid_sum.data() + static_cast<uint_fast64_t>(y) * res / H * res * 3;
+			uint32_t * const ts = scratch.thumb_sum.data() + static_cast<uint_fast64_t>(y) * TH / H * TW * 3;
+			for (uint_fast32_t x = 0; x < W; x++) {
+				uint32_t const px = line[x];
+				uint32_t const r = (px >> 16) & 0xFF, g = (px >> 8) & 0xFF, b = px & 0xFF;
+				hR[r]++; hG[g]++; hB[b]++;
+				uint32_t * gc = gs + gx[x] * 3, * tc = ts + tx[x] * 3;
+				gc[0] += r; gc[1] += g; gc[2] += b;
+				tc[0] += r; tc[1] += g; tc[2] += b;
+			}
+		}
+		
+		size_t const plane = static_cast<size_t>(res) * res;
+		uint8_t * pR = sigs.grid(id), * pG = pR + plane, * pB = pG + plane;
+		uint32_t const * gs = scratch.grid_sum.data();
+		for (uint_fast16_t y = 0; y < res; y++) for (uint_fast16_t x = 0; x < res; x++, gs += 3) {
+			uint32_t n = scratch.grid_h[y] * scratch.grid_w[x];
+			*pR++ = (gs[0] + n / 2) / n;
+			*pG++ = (gs[1] + n / 2) / n;
+			*pB++ = (gs[2] + n / 2) / n;
+		}
+		
+		thumb = QImage {tsize, QImage::Format_RGB32};
+		uint32_t const * ts = scratch.thumb_sum.data();
+		for (uint_fast32_t y = 0; y < TH; y++) {
+			QRgb * line = reinterpret_cast<QRgb *>(thumb.scanLine(y));
+			for (uint_fast32_t x = 0; x < TW; x++, ts += 3) {
+				uint32_t n = scratch.thumb_h[y] * scratch.thumb_w[x];
+				line[x] = qRgb((ts[0] + n / 2) / n, (ts[1] + n / 2) / n, (ts[2] + n / 2) / n);
+			}
+		}
+		
+		float const norm = 1.0f / (static_cast<float>(W) * H);
+		float * h = sigs.hist(id);
+		for (size_t i = 0; i < CuttleSignatureArena::hist_size; i++) h[i] = std::sqrt(scratch.hist[i] * norm);
 	}
 	
-	cv::Mat cvm = cv::Mat(res, res, CV_8UC3, (void *)test.data());
-	std::vector<cv::Mat> bgr_planes;
-    cv::split( cvm, bgr_planes );
-	
-	int histSize = 256;
-    float range[] = { 0, 256 }; //the upper boundary is exclusive
-    const float* histRange[] = { range };
-	
-	calcHist(&bgr_planes[0], 1, 0, cv::Mat(), b_hist, 1, &histSize, histRange, true, false);
-	calcHist(&bgr_planes[1], 1, 0, cv::Mat(), g_hist, 1, &histSize, histRange, true, false);
-	calcHist(&bgr_planes[2], 1, 0, cv::Mat(), r_hist, 1, &histSize, histRange, true, false);
+	{
+		CuttleTraceSpan span {"image hash"};
+		QCryptographicHash hash {QCryptographicHash::Sha512};
+		hash.addData(reinterpret_cast<char const *>(sigs.grid(id)), sigs.getGridSize());
+		QByteArray digest = hash.result();
+		memcpy(sigs.imageHash(id).data(), digest.constData(), std::min<size_t>(digest.size(), sizeof(CuttleSignatureArena::ImageHash)));
+	}
 	
-	normalize(b_hist, b_hist, 1.0, 0.0, cv::NORM_L1);
-	normalize(g_hist, g_hist, 1.0, 0.0, cv::NORM_L1);
-	normalize(r_hist, r_hist, 1.0, 0.0, cv::NORM_L1);
+	sigs.derive(id);
 }
 
-CuttleMatchData CuttleSet::compare(CuttleSet const * A, CuttleSet const * B) {
-	
-	if (A == B) return perfect_match;
-	if (A->img_hash == B->img_hash && A->getImage() == B->getImage()) return perfect_match;
-	
-	CuttleMatchData dat;
-	dat.value = 0;
-	dat.value += 0.3 * compare_pix(A, B);
-	dat.value += 0.7 * compare_hist(A, B);
-	
-	return dat;
+void CuttleSet::copySignature(CuttleSet const & other, CuttleSignatureArena & sigs) {
+	res = other.res;
+	img_size = other.img_size;
+	thumb = other.thumb;
+	sigs.copy(id, other.id);
+}
+
+template <size_t N> static inline uint64_t sum_abs_diff(uint32_t const * A, uint32_t const * B) {
+	uint64_t sum = 0;
+	for (size_t i = 0; i < N; i++) sum += A[i] > B[i] ? A[i] - B[i] : B[i] - A[i];
+	return sum;
 }
 
-double CuttleSet::compare_pix(CuttleSet const * A, CuttleSet const * B) {
-	double match = 0;
-	uint_fast16_t res = A->res;
+CuttleMatchData CuttleSet::compare(CuttleSignatureArena const & sigs, CuttleSet const * A, CuttleSet const * B, double floor) {
 	
-	for (uint_fast16_t i = 0; i < res * res; i++) {
-		
-		QColor const & cA = A->data[i];
-		QColor const & cB = B->data[i];
-		
-		double mR = abs(cA.redF() - cB.redF());
-		double mG = abs(cA.greenF() - cB.greenF());
-		double mB = abs(cA.blueF() - cB.blueF());
+	if (A == B) return perfect_match;
+	if (A->file_hash && A->file_hash == B->file_hash && A->fi.size() == B->fi.size()) return perfect_match;
+	uint_fast32_t const a = A->id, b = B->id;
+	// same downscaled pixels and the same full dimensions, without a matching file digest this is as far as we verify without decoding
+	if (sigs.imageHash(a) == sigs.imageHash(b) && A->img_size == B->img_size && !memcmp(sigs.grid(a), sigs.grid(b), sigs.getGridSize())) return signature_match;
+	
+	double hist_bound = 1.0;
+	if (floor > 0) {
+		// The cascade only ever over-estimates. Summing pixels over a cell cannot grow their absolute difference, so the
+		// cell sums bound the pixel SAD from below. Merging bins cannot shrink the Bhattacharyya coefficient, so the
+		// 16 bin histograms bound the histogram score from above.
+		double const pix_norm = 255.0 * sigs.getGridSize();
+		float const * hA = sigs.hist16(a), * hB = sigs.hist16(b);
+		double min_bc = 1.0;
+		for (size_t c = 0; c < 3; c++) {
+			double bc = 0;
+			for (size_t i = 0; i < 16; i++) bc += hA[c * 16 + i] * hB[c * 16 + i];
+			min_bc = std::min(min_bc, bc);
+		}
+		hist_bound = std::min(1.0, 1.0 - std::sqrt(std::max(0.0, 1.0 - min_bc)) + 1e-6);
 		
-		match += (3.0 - (mR + mG + mB)) / 3.0;
+		double pix_bound = 1.0 - sum_abs_diff<48>(sigs.grid4(a), sigs.grid4(b)) / pix_norm;
+		if (0.3 * pix_bound + 0.7 * hist_bound < floor) {
+			CuttleTrace::count(CuttleCounter::pairs_rejected_cascade);
+			return invalid_match;
+		}
+		pix_bound = 1.0 - sum_abs_diff<192>(sigs.grid8(a), sigs.grid8(b)) / pix_norm;
+		if (0.3 * pix_bound + 0.7 * hist_bound < floor) {
+			CuttleTrace::count(CuttleCounter::pairs_rejected_cascade);
+			return invalid_match;
+		}
 	}
 	
-	return match / (res * res);
-}
-
-double CuttleSet::compare_hist(CuttleSet const * A, CuttleSet const * B) {
-	double rH = compareHist(A->r_hist, B->r_hist, cv::HISTCMP_BHATTACHARYYA);
-	double gH = compareHist(A->g_hist, B->g_hist, cv::HISTCMP_BHATTACHARYYA);
-	double bH = compareHist(A->b_hist, B->b_hist, cv::HISTCMP_BHATTACHARYYA);
-	double sH = std::max({rH, gH, bH});
+	double value = 0.3 * sigs.comparePix(a, b);
+	if (value + 0.7 * hist_bound < floor) {
+		CuttleTrace::count(CuttleCounter::pairs_rejected_cascade);
+		return invalid_match;
+	}
+	value += 0.7 * sigs.compareHist(a, b);
 	
-	return 1 - sH;
+	return CuttleMatchData::make(value);
 }
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <mutex>
+
+// Bounded multi producer, multi consumer queue. push blocks while the queue is full, which is the backpressure that keeps
+// a fast stage from running ahead of a slow one, and pop blocks while it is empty until every producer is done.
+template <typename T> class CuttleQueue {
+public:
+	CuttleQueue(size_t capacity = std::numeric_limits<size_t>::max(), size_t producers = 1) : capacity(capacity), producers(producers) {}
+	
+	// false once the queue was aborted, the value is dropped
+	bool push(T && value) {
+		std::unique_lock<std::mutex> lock {lk};
+		not_full.wait(lock, [this](){ return aborted || items.size() < capacity; });
+		if (aborted) return false;
+		items.push_back(std::move(value));
+		not_empty.notify_one();
+		return true;
+	}
+	
+	// false once every producer is done and the queue is drained, or it was aborted
+	bool pop(T & value) {
+		std::unique_lock<std::mutex> lock {lk};
+		not_empty.wait(lock, [this](){ return aborted || !producers || !items.empty(); });
+		if (aborted || items.empty()) return false;
+		value = std::move(items.front());
+		items.pop_front();
+		not_full.notify_one();
+		return true;
+	}
+	
+	// one producer is finished, the last one lets the consumers drain and stop
+	void done() {
+		std::lock_guard<std::mutex> guard {lk};
+		if (producers && !--producers) not_empty.notify_all();
+	}
+	
+	// stops producers and consumers alike, whatever is still queued is discarded
+	void abort() {
+		std::lock_guard<std::mutex> guard {lk};
+		aborted = true;
+		items.clear();
+		not_full.notify_all();
+		not_empty.notify_all();
+	}
+	
+private:
+	size_t const capacity;
+	size_t producers;
+	bool aborted = false;
+	std::mutex lk;
+	std::condition_variable not_full, not_empty;
+	std::deque<T> items {};
+};
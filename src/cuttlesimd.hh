@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// sum of absolute differences between two byte arrays
+inline uint64_t sad_u8(uint8_t const * A, uint8_t const * B, size_t n) {
+	uint64_t sum = 0;
+	size_t i = 0;
+#if defined(__AVX2__)
+	__m256i acc = _mm256_setzero_si256();
+	for (; i + 32 <= n; i += 32) {
+		__m256i a = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(A + i));
+		__m256i b = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(B + i));
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(a, b));
+	}
+	__m128i acc128 = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	sum += static_cast<uint64_t>(_mm_cvtsi128_si64(acc128)) + static_cast<uint64_t>(_mm_extract_epi64(acc128, 1));
+#endif
+#if defined(__SSE2__)
+	__m128i acc16 = _mm_setzero_si128();
+	for (; i + 16 <= n; i += 16) {
+		__m128i a = _mm_loadu_si128(reinterpret_cast<__m128i const *>(A + i));
+		__m128i b = _mm_loadu_si128(reinterpret_cast<__m128i const *>(B + i));
+		acc16 = _mm_add_epi64(acc16, _mm_sad_epu8(a, b));
+	}
+	sum += static_cast<uint64_t>(_mm_cvtsi128_si64(acc16)) + static_cast<uint64_t>(_mm_cvtsi128_si64(_mm_unpackhi_epi64(acc16, acc16)));
+#endif
+	for (; i < n; i++) sum += std::abs(static_cast<int>(A[i]) - static_cast<int>(B[i]));
+	return sum;
+}
@@ -0,0 +1,127 @@
+#include "cuttletrace.hh"
+
+#include <QFile>
+#include <QSaveFile>
+#include <QTextStream>
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+std::atomic_bool CuttleTrace::active {false};
+std::atomic_int_fast64_t CuttleTrace::counters[static_cast<size_t>(CuttleCounter::count_)] {};
+
+static char const * const counter_names[] = {
+	"bytes read",
+	"decode failures",
+	"cache hits",
+	"cache misses",
+	"pairs compared",
+	"pairs skipped (group)",
+	"pairs rejected (cascade)",
+};
+
+namespace {
+	struct event_t {
+		char const * name;
+		uint64_t begin, end;
+	};
+	
+	struct sample_t {
+		uint64_t time;
+		int64_t values[static_cast<size_t>(CuttleCounter::count_)];
+	};
+	
+	struct thread_buffer_t {
+		uint32_t tid;
+		std::mutex lk; // only contended by flush
+		std::vector<event_t> events;
+	};
+	
+	struct registry_t {
+		std::mutex lk;
+		QString path;
+		std::vector<std::unique_ptr<thread_buffer_t>> buffers;
+		std::vector<sample_t> samples;
+		std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+	};
+	
+	registry_t & registry() {
+		static registry_t r {};
+		return r;
+	}
+	
+	thread_buffer_t & local_buffer() {
+		thread_local thread_buffer_t * buffer = nullptr;
+		if (!buffer) {
+			registry_t & r = registry();
+			std::lock_guard<std::mutex> guard {r.lk};
+			r.buffers.emplace_back(new thread_buffer_t {});
+			buffer = r.buffers.back().get();
+			buffer->tid = r.buffers.size();
+		}
+		return *buffer;
+	}
+}
+
+void CuttleTrace::enable(QString const & path) {
+	registry_t & r = registry();
+	std::lock_guard<std::mutex> guard {r.lk};
+	r.path = path;
+	active.store(!path.isEmpty());
+}
+
+void CuttleTrace::enableFromEnvironment() {
+	QString path = qEnvironmentVariable("CUTTLE_TRACE");
+	if (!path.isEmpty()) enable(path);
+}
+
+// microseconds since the trace epoch, offset by one so a valid timestamp is never 0
+uint64_t CuttleTrace::now() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - registry().epoch).count() + 1;
+}
+
+void CuttleTrace::span(char const * name, uint64_t begin, uint64_t end) {
+	thread_buffer_t & buffer = local_buffer();
+	std::lock_guard<std::mutex> guard {buffer.lk};
+	buffer.events.push_back({name, begin, end});
+}
+
+void CuttleTrace::sample() {
+	if (!enabled()) return;
+	sample_t s {now(), {}};
+	for (size_t i = 0; i < static_cast<size_t>(CuttleCounter::count_); i++) s.values[i] = counters[i].load(std::memory_order_relaxed);
+	registry_t & r = registry();
+	std::lock_guard<std::mutex> guard {r.lk};
+	r.samples.push_back(s);
+}
+
+bool CuttleTrace::flush() {
+	if (!enabled()) return false;
+	sample();
+	
+	registry_t & r = registry();
+	std::lock_guard<std::mutex> guard {r.lk};
+	QSaveFile file {r.path};
+	if (!file.open(QIODevice::WriteOnly)) return false;
+	QTextStream out {&file};
+	
+	out << "{\"traceEvents\":[\n";
+	out << "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"cuttlefish\"}}";
+	for (auto const & buffer : r.buffers) {
+		std::lock_guard<std::mutex> bguard {buffer->lk};
+		out << ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << buffer->tid << ",\"args\":{\"name\":\"thread " << buffer->tid << "\"}}";
+		for (event_t const & e : buffer->events) {
+			out << ",\n{\"ph\":\"X\",\"cat\":\"cuttle\",\"name\":\"" << e.name << "\",\"pid\":1,\"tid\":" << buffer->tid << ",\"ts\":" << e.begin << ",\"dur\":" << (e.end - e.begin) << '}';
+		}
+	}
+	for (sample_t const & s : r.samples) {
+		for (size_t i = 0; i < static_cast<size_t>(CuttleCounter::count_); i++) {
+			out << ",\n{\"ph\":\"C\",\"name\":\"" << counter_names[i] << "\",\"pid\":1,\"ts\":" << s.time << ",\"args\":{\"value\":" << s.values[i] << "}}";
+		}
+	}
+	out << "\n]}\n";
+	out.flush();
+	return file.commit();
+}
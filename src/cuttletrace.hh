@@ -0,0 +1,50 @@
+#pragma once
+
+#include <QString>
+
+#include <atomic>
+#include <cstdint>
+
+// Chrome trace (chrome://tracing, Perfetto) recording, spans are kept per thread and written out by flush
+
+enum struct CuttleCounter {
+	bytes_read,
+	decode_failures,
+	cache_hits,
+	cache_misses,
+	pairs_compared,
+	pairs_skipped_group,
+	pairs_rejected_cascade,
+	count_
+};
+
+class CuttleTrace final {
+public:
+	// an empty path disables tracing
+	static void enable(QString const & path);
+	static inline bool enabled() { return active.load(std::memory_order_relaxed); }
+	static void enableFromEnvironment();
+	
+	static uint64_t now();
+	static void span(char const * name, uint64_t begin, uint64_t end);
+	static inline void count(CuttleCounter counter, int64_t delta = 1) {
+		if (enabled()) counters[static_cast<size_t>(counter)].fetch_add(delta, std::memory_order_relaxed);
+	}
+	// records the current value of every counter
+	static void sample();
+	static bool flush();
+private:
+	static std::atomic_bool active;
+	static std::atomic_int_fast64_t counters[static_cast<size_t>(CuttleCounter::count_)];
+};
+
+struct CuttleTraceSpan final {
+	CuttleTraceSpan(char const * name) : name(name), begin(CuttleTrace::enabled() ? CuttleTrace::now() : 0) {}
+	~CuttleTraceSpan() {
+		if (begin) CuttleTrace::span(name, begin, CuttleTrace::now());
+	}
+	CuttleTraceSpan(CuttleTraceSpan const &) = delete;
+private:
+	char const * name;
+	uint64_t begin;
+};
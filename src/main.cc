@@ -1,12 +1,21 @@
 #include <QApplication>
 #include <QTextCodec>
 
+#include <cstring>
+
 #include "cuttle.hh"
+#include "cuttletrace.hh"
 
 int main(int argc, char * * argv) {	
+	CuttleTrace::enableFromEnvironment();
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-b") || !strcmp(argv[i], "--batch")) return cuttle_batch(argc, argv);
+	}
 	QApplication app {argc, argv};
 	QTextCodec::setCodecForLocale(QTextCodec::codecForName("UTF-8"));
 	CuttleCore * cmw = new CuttleCore {};
 	cmw->show();
-	return app.exec();
+	int ret = app.exec();
+	CuttleTrace::flush();
+	return ret;
 }